@@ -0,0 +1,77 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#ifndef __TORTILLA_BITFIELD_H__
+#define __TORTILLA_BITFIELD_H__
+
+namespace Tortilla {
+
+/*! \brief A fixed number of bits, such as a map of pieces
+ *
+ *  Bits are stored 64 to a word, so that entire maps can be counted and
+ *  searched a word (or, where the CPU supports it, a vector of words) at a
+ *  time. Bits beyond the size are always zero.
+ */
+class Bitfield {
+public:
+	/*! \brief Constructs a new bitfield
+	 *  \param num Number of bits, all of which will be cleared
+	 */
+	Bitfield(size_t num = 0);
+
+	/*! \brief Change the number of bits
+	 *
+	 *  Any bits added will be cleared.
+	 */
+	void resize(size_t num);
+
+	//! \brief Retrieve the number of bits
+	size_t size() const { return numBits; }
+
+	//! \brief Retrieve a bit
+	bool operator[](size_t i) const {
+		return (words[i / 64] >> (i % 64)) & 1;
+	}
+
+	//! \brief Change a bit
+	void set(size_t i, bool value = true) {
+		if (value)
+			words[i / 64] |= (uint64_t)1 << (i % 64);
+		else
+			words[i / 64] &= ~((uint64_t)1 << (i % 64));
+	}
+
+	//! \brief Retrieve the number of bits set
+	size_t count() const;
+
+	/*! \brief Find the first bit set
+	 *  \param from Bit to start looking at
+	 *  \return Index of the bit, or size() if there is none
+	 */
+	size_t findNext(size_t from = 0) const;
+
+	/*! \brief Load the bits from a BITFIELD message
+	 *  \param data Data to load, which must be (size() + 7) / 8 bytes
+	 *
+	 *  The first bit is the most significant bit of the first byte. Any
+	 *  bits beyond the size are ignored.
+	 */
+	void load(const uint8_t* data);
+
+	/*! \brief Store the bits as a BITFIELD message
+	 *  \param data Buffer to fill, which must be (size() + 7) / 8 bytes
+	 */
+	void store(uint8_t* data) const;
+
+private:
+	//! \brief Number of bits
+	size_t numBits;
+
+	//! \brief Bits, 64 per word with the first bit as the least significant
+	std::vector<uint64_t> words;
+};
+
+}
+
+#endif /* __TORTILLA_BITFIELD_H__ */
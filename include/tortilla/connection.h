@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdint.h>
 #include <string>
 #include <stdint.h>
@@ -34,6 +35,17 @@ public:
 	 */
 	ssize_t write(const void* buf, size_t len);
 
+	/*! \brief Writes a number of buffers to the other side at once
+	 *  \param iov Buffers to write
+	 *  \param iovcnt Number of buffers
+	 *  \param more If true, more data will follow immediately
+	 *  \return Number of bytes sent
+	 *
+	 *  Setting more allows the OS to hold off transmitting a partial segment
+	 *  until the next write, where supported.
+	 */
+	ssize_t writev(const struct iovec* iov, int iovcnt, bool more = false);
+
 	/*! \brief Reads data from the other side
 	 *  \param buf Buffer to read
 	 *  \param len Number of bytes to read
@@ -0,0 +1,92 @@
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <list>
+
+#ifndef __TORTILLA_CONNECTIONMANAGER_H__
+#define __TORTILLA_CONNECTIONMANAGER_H__
+
+namespace Tortilla {
+
+/*! \brief Maximum number of outgoing connections being set up at any time
+ *
+ *  This covers all torrents; see TORRENT_MAX_HALFOPEN for the per-torrent
+ *  limit.
+ */
+#define CONNECTIONMANAGER_MAX_HALFOPEN	32
+
+class Overseer;
+class PendingPeer;
+class Torrent;
+
+/*! \brief Sets up outgoing connections to peers
+ *
+ *  Connection attempts are queued and handled by a seperate thread, so that
+ *  hostname resolution never stalls the caller. Once connect(2) has been
+ *  issued, the resulting peer is handed to its torrent; the attempt counts
+ *  as half-open until the peer signals the connection is done.
+ */
+class ConnectionManager {
+friend	void* connectionmanager_thread(void* ptr);
+public:
+	/*! \brief Constructs a new connection manager
+	 *  \param o Overseer we belong to
+	 */
+	ConnectionManager(Overseer* o);
+
+	/*! \brief Destroys the connection manager
+	 *
+	 *  Any attempts still queued are discarded.
+	 */
+	~ConnectionManager();
+
+	/*! \brief Queue a connection attempt
+	 *  \param pp Peer to connect to, will be owned by the connection manager
+	 */
+	void connect(PendingPeer* pp);
+
+	//! \brief Called once a half-open connection is connected or gone
+	void connectionDone();
+
+	/*! \brief Cancels all connection attempts of a torrent
+	 *
+	 *  If an attempt is currently in progress, this waits for it to finish.
+	 */
+	void cancelTorrent(Torrent* t);
+
+protected:
+	//! \brief Launch the connection thread
+	void run();
+
+private:
+	//! \brief Attempts waiting to be made
+	std::list<PendingPeer*> queue;
+
+	//! \brief Number of half-open connections
+	unsigned int numHalfOpen;
+
+	//! \brief Torrent we are currently connecting for, if any
+	Torrent* current;
+
+	//! \brief Mutex protecting our data
+	boost::mutex mtx_data;
+
+	//! \brief Condition variable used to awaken the thread
+	boost::condition_variable cv;
+
+	//! \brief Condition variable signalled once an attempt is finished
+	boost::condition_variable cv_done;
+
+	//! \brief Are we terminating?
+	bool terminating;
+
+	//! \brief Overseer we are bound to
+	Overseer* overseer;
+
+	//! \brief Reference to our thread
+	boost::thread thread;
+};
+
+}
+
+#endif /* __TORTILLA_CONNECTIONMANAGER_H__ */
@@ -0,0 +1,48 @@
+#ifndef __TORTILLA_CPUFEATURES_H__
+#define __TORTILLA_CPUFEATURES_H__
+
+namespace Tortilla {
+
+/*! \brief Reports instruction set extensions supported by the CPU
+ *
+ *  The CPU is probed once, on first use. On anything but x86, no extensions
+ *  are reported.
+ */
+class CPUFeatures {
+public:
+	//! \brief Does the CPU support SSE2?
+	static bool hasSSE2() { return get().sse2; }
+
+	//! \brief Does the CPU support SSSE3?
+	static bool hasSSSE3() { return get().ssse3; }
+
+	//! \brief Does the CPU support SSE4.1?
+	static bool hasSSE41() { return get().sse41; }
+
+	//! \brief Does the CPU and OS support AVX2?
+	static bool hasAVX2() { return get().avx2; }
+
+	//! \brief Does the CPU support BMI1 and BMI2?
+	static bool hasBMI() { return get().bmi; }
+
+	//! \brief Does the CPU support the SHA extensions?
+	static bool hasSHA() { return get().sha; }
+
+private:
+	//! \brief Probes the CPU
+	CPUFeatures();
+
+	//! \brief Retrieve the probed features
+	static const CPUFeatures& get();
+
+	bool sse2;
+	bool ssse3;
+	bool sse41;
+	bool avx2;
+	bool bmi;
+	bool sha;
+};
+
+}
+
+#endif /* __TORTILLA_CPUFEATURES_H__ */
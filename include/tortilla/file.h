@@ -1,4 +1,5 @@
 #include <boost/thread/shared_mutex.hpp>
+#include <sys/types.h>
 #include <string>
 #include <time.h>
 
@@ -7,6 +8,9 @@
 
 namespace Tortilla {
 
+//! \brief Size of the bounce buffer used if the OS can't send from files
+#define FILE_SEND_BUFFER_SIZE 16384
+
 class FileManager;
 
 //! \brief Implements a basic file suitable for reading/writing
@@ -40,6 +44,28 @@ public:
 	 */
 	void read(off_t offset, void* buf, size_t len);
 
+	/*! \brief Send a piece of the file to a socket
+	 *  \param sockfd Socket to send to
+	 *  \param offset Byte offset from which to send
+	 *  \param len Number of bytes to send
+	 *  \returns Number of bytes sent, or -1 on error
+	 *
+	 *  Where possible, the data is sent without copying it through our
+	 *  address space. The amount sent may be short, or even zero, if the
+	 *  socket is full. If the file can't supply the data, for example because
+	 *  it is shorter than it should be, this is an error.
+	 */
+	ssize_t send(int sockfd, off_t offset, size_t len);
+
+	/*! \brief Hint that a piece of the file will be needed soon
+	 *  \param offset Byte offset from which to read
+	 *  \param len Number of bytes that will be needed
+	 *
+	 *  This asks the OS to start reading the data in the background; it
+	 *  does not wait for the data to arrive.
+	 */
+	void prefetch(off_t offset, size_t len);
+
 	//! \brief Retrieve the file length
 	off_t getLength() const { return length; }
 
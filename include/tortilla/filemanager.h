@@ -41,6 +41,12 @@ public:
 	//! \brief Read from a file
 	void readFile(File* f, off_t offset, void* buf, size_t len);
 
+	//! \brief Send a part of a file to a socket
+	ssize_t sendFile(File* f, int sockfd, off_t offset, size_t len);
+
+	//! \brief Start reading a part of a file in the background
+	void prefetchFile(File* f, off_t offset, size_t len);
+
 	/*! \brief Sets the maximum number of files that will be opened
 	 *  \param max New maximum number
 	 */
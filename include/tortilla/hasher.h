@@ -2,7 +2,10 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/condition_variable.hpp>
-#include <queue>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
 #include "torrent.h"
 
 #ifndef __TORTILLA_HASHER_H__
@@ -27,58 +30,129 @@ private:
 	unsigned int piecenum;
 };
 
+/*! \brief Queue of pieces to hash, fair between torrents
+ *
+ *  Pieces are handed out round-robin across torrents, so that a torrent with
+ *  a large amount of pieces to hash doesn't starve the others.
+ */
+class HasherQueue {
+public:
+	//! \brief Add a piece to the queue
+	void push(Torrent* t, unsigned int piece);
+
+	/*! \brief Remove the next piece to hash
+	 *  \returns false if the queue is empty
+	 */
+	bool pop(HasherItem& hi);
+
+	/*! \brief Remove the next piece of a given torrent
+	 *  \returns false if the torrent has no pieces queued
+	 *
+	 *  This does not affect the order in which torrents are served.
+	 */
+	bool popTorrent(Torrent* t, HasherItem& hi);
+
+	//! \brief Removes all pieces of a torrent
+	void removeTorrent(Torrent* t);
+
+	//! \brief Is the queue empty?
+	bool empty() const { return order.empty(); }
+
+private:
+	//! \brief Torrents with pieces to hash, in order of service
+	std::list<Torrent*> order;
+
+	//! \brief Pieces to hash per torrent
+	std::map<Torrent*, std::list<unsigned int> > pieces;
+};
+
 class Overseer;
 
-//! \brief Implements a hashing thread, which checks the torrent contents hash
+/*! \brief Implements a pool of hashing threads, which check the torrent contents hash
+ *
+ *  Freshly downloaded pieces take precedence over pieces that are
+ *  rechecked, as the latter may take hours for large torrents.
+ */
 class Hasher {
 friend	void* hasher_thread(void* ptr);
 public:
-	/*! \brief Construct a new hasher thread
+	/*! \brief Construct a new hasher
 	 *  \param o Overseer we belong to
+	 *  \param numThreads Number of hashing threads to use
 	 */
-	Hasher(Overseer* o);
+	Hasher(Overseer* o, unsigned int numThreads);
 
 	/*! \brief Destructs the hasher
 	 *
-	 *  This will remove the hashing thread as well.
+	 *  This will remove the hashing threads as well.
 	 */
 	~Hasher();
 
 	/*! \brief Add a piece to hash
 	 *  \param t Torrent to hash for
 	 *  \param num Piece to hash
+	 *  \param recheck Is this a recheck of existing data?
 	 */
-	void addPiece(Torrent* t, unsigned int num);
+	void addPiece(Torrent* t, unsigned int num, bool recheck = false);
 
-	//! \brief Cancels hashing of all pieces of a torrent
+	/*! \brief Cancels hashing of all pieces of a torrent
+	 *
+	 *  If any pieces of the torrent are currently being hashed, this waits
+	 *  until they are done.
+	 */
 	void cancelTorrent(Torrent* t);
 
 protected:
-	//! \brief Launch the hashing thread
+	//! \brief Launch a hashing thread
 	void run();
 
 private:
-	/*! \brief Queue of items that need to be hashed
+	//! \brief Hash a single piece and report the result
+	void hashPiece(HasherItem& hi);
+
+	/*! \brief Hash a number of pieces of the same torrent side by side
 	 *
-	 *  This is implemented as a list, as we need to remove items
-	 *  from torrents that no longer exist.
+	 *  Pieces that do not have the torrent's piece length are hashed on their
+	 *  own.
 	 */
-	std::list<HasherItem> hashQueue;
+	void hashBatch(std::vector<HasherItem>& items);
 
-	//! \brief Reference to our thread
-	boost::thread thread;
+	//! \brief Freshly downloaded pieces that need to be hashed
+	HasherQueue freshQueue;
+
+	//! \brief Pieces with existing data that need to be rechecked
+	HasherQueue recheckQueue;
+
+	/*! \brief Torrents currently being hashed
+	 *
+	 *  A torrent is listed once for every thread hashing one of its pieces.
+	 */
+	std::multiset<Torrent*> busy;
 
 	//! \brief Mutex protecting our queue
 	boost::mutex mtx_data;
 
-	//! \brief Condition variable used to awaken the thread
+	//! \brief Condition variable used to awaken the threads
 	boost::condition_variable cv;
 
+	//! \brief Condition variable signalled once a piece is hashed
+	boost::condition_variable cv_done;
+
 	//! \brief Are we terminating?
 	bool terminating;
 
+	/*! \brief Maximum number of rechecked pieces to hash at once
+	 *
+	 *  Recheck items of the same torrent are independent and equal in length,
+	 *  so they can be hashed side by side using MultiHashSHA1.
+	 */
+	unsigned int batchSize;
+
 	//! \brief Overseer we are bound to
 	Overseer* overseer;
+
+	//! \brief Our hashing threads
+	std::vector<boost::thread*> threads;
 };
 
 }
@@ -11,6 +11,7 @@ class TrackerTalker;
 
 class HTTPRequest {
 friend class Receiver;
+friend class Overseer;
 public:
 	/*! \brief Initialize a HTTP request
 	 *  \param tt Tracker communicator the request belongs to
@@ -0,0 +1,65 @@
+#include <boost/atomic.hpp>
+
+#ifndef __TORTILLA_MPSCQUEUE_H__
+#define __TORTILLA_MPSCQUEUE_H__
+
+namespace Tortilla {
+
+class MPSCQueue;
+
+//! \brief Base class for anything that can be placed in a MPSCQueue
+class MPSCNode {
+friend class MPSCQueue;
+public:
+	MPSCNode() : mpsc_next((MPSCNode*)NULL) { }
+
+private:
+	//! \brief Next node in the queue
+	boost::atomic<MPSCNode*> mpsc_next;
+};
+
+/*! \brief Lock-free multiple producer, single consumer queue
+ *
+ *  Any thread may push nodes, but only a single thread at a time may pop
+ *  them. Nodes are linked intrusively, so pushing never allocates.
+ *
+ *  This is Dmitry Vyukov's intrusive MPSC queue: a push is a single atomic
+ *  exchange. A pop may miss a node whose push is still in progress; the
+ *  producer is expected to notify the consumer after pushing anyway.
+ */
+class MPSCQueue {
+public:
+	//! \brief Constructs an empty queue
+	MPSCQueue();
+
+	//! \brief Adds a node to the end of the queue; may be called by any thread
+	void push(MPSCNode* node);
+
+	/*! \brief Removes the node at the front of the queue
+	 *  \returns The node, or NULL if there is none
+	 *
+	 *  This may only be called by the consumer.
+	 */
+	MPSCNode* pop();
+
+	/*! \brief Is the queue empty?
+	 *
+	 *  A queue with a push in progress isn't considered empty. This may
+	 *  only be called by the consumer.
+	 */
+	bool empty() const;
+
+private:
+	//! \brief Most recently pushed node
+	boost::atomic<MPSCNode*> head;
+
+	//! \brief Node to be popped next, only touched by the consumer
+	MPSCNode* tail;
+
+	//! \brief Placeholder node, which keeps the queue non-empty
+	MPSCNode stub;
+};
+
+}
+
+#endif /* __TORTILLA_MPSCQUEUE_H__ */
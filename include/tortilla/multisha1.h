@@ -0,0 +1,80 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __TORTILLA_MULTISHA1_H__
+#define __TORTILLA_MULTISHA1_H__
+
+namespace Tortilla {
+
+//! \brief Maximum number of buffers that can be hashed at once
+#define MULTISHA1_MAX_LANES 8
+
+/*! \brief Hashes a number of equal-length buffers in lockstep
+ *
+ *  SHA1 is inherently serial within a single buffer, but independent buffers
+ *  can be hashed side by side, one per SIMD lane. This yields several times
+ *  the throughput of hashing the buffers one by one, unless the CPU has
+ *  dedicated SHA instructions.
+ */
+class MultiHashSHA1 {
+public:
+	/*! \brief Constructs a new multi-buffer hasher
+	 *  \param numLanes Number of buffers to hash, at most MULTISHA1_MAX_LANES
+	 */
+	MultiHashSHA1(unsigned int numLanes);
+
+	/*! \brief Process the next piece of every buffer
+	 *  \param bufs Data to process, one pointer per lane
+	 *  \param size Number of bytes to process for every lane
+	 */
+	void process(const uint8_t* const* bufs, size_t size);
+
+	/*! \brief Retrieves the hash of a lane
+	 *
+	 *  The hashes will be calculated here if needed, after which no more
+	 *  data can be processed.
+	 */
+	const uint8_t* getHash(unsigned int lane);
+
+	//! \brief Retrieve the number of lanes the CPU can process at once
+	static unsigned int getMaxLanes();
+
+	/*! \brief Retrieve the number of buffers worth hashing at once
+	 *
+	 *  This is 1 if hashing the buffers one by one using HashSHA1 is at least
+	 *  as fast.
+	 */
+	static unsigned int getPreferredLanes();
+
+private:
+	//! \brief Length of a SHA1 hash
+	static const int SHA1_DIGEST_LENGTH = 20;
+
+	//! \brief Process whole blocks of every lane
+	void processBlocks(const uint8_t* const* bufs, size_t numBlocks);
+
+	//! \brief Number of lanes in use
+	unsigned int lanes;
+
+	//! \brief Intermediate hash values, one column per lane
+	uint32_t H[5][MULTISHA1_MAX_LANES];
+
+	//! \brief Number of bytes processed per lane
+	uint64_t length;
+
+	//! \brief Partial blocks, per lane
+	uint8_t tail[MULTISHA1_MAX_LANES][64];
+
+	//! \brief Number of bytes in the partial blocks
+	unsigned int tailLength;
+
+	//! \brief Have we computed the hashes
+	bool computed;
+
+	//! \brief Computed hashes, if any
+	uint8_t hash[MULTISHA1_MAX_LANES][SHA1_DIGEST_LENGTH];
+};
+
+}
+
+#endif /* __TORTILLA_MULTISHA1_H__ */
@@ -3,11 +3,13 @@
 #include <map>
 #include <stdint.h>
 #include <string>
+#include <vector>
 #include "callbacks.h"
 #include "connection.h"
 #include "hasher.h"
 #include "torrent.h"
 #include "sender.h"
+#include "tokenbucket.h"
 
 #ifndef __TORTILLA_OVERSEER_H__
 #define __TORTILLA_OVERSEER_H__
@@ -27,6 +29,8 @@ class Callbacks;
 class FileManager;
 class Receiver;
 class HTTPRequest;
+class ConnectionManager;
+class PendingPeer;
 
 /*! \brief Responsible for overseeing all torrents
  */
@@ -40,8 +44,10 @@ public:
 	 *  \param portnr TCP port number to use for incoming connections
 	 *  \param tr Tracer object to use, or NULL
 	 *  \param cb Callbacks object to use, or NULL
+	 *  \param numReceivers Number of receiver threads, or 0 for one per CPU
+	 *  \param numHashers Number of hashing threads, or 0 for one per CPU
 	 */
-	Overseer(unsigned int portnr, Tracer* tr, Callbacks* cb = NULL);
+	Overseer(unsigned int portnr, Tracer* tr, Callbacks* cb = NULL, unsigned int numReceivers = 0, unsigned int numHashers = 0);
 
 	//! \brief Destroys the overseer and all torrents it manages
 	~Overseer();
@@ -78,10 +84,30 @@ public:
 	 *  An upload rate of zero indicates no upload rate throtteling is
 	 *  performed.
 	 */
-	inline void setUploadRate(uint32_t rate) { upload_rate = rate; }
+	inline void setUploadRate(uint32_t rate) { upload_bucket.setRate(rate); }
 
 	//! \brief Retrieve the upload rate, in bytes/second
-	inline uint32_t getUploadRate() const { return upload_rate; }
+	inline uint32_t getUploadRate() const { return upload_bucket.getRate(); }
+
+	/*! \brief Set the download rate, in bytes/second
+	 *
+	 *  A download rate of zero indicates no download rate throtteling is
+	 *  performed.
+	 */
+	inline void setDownloadRate(uint32_t rate) { download_bucket.setRate(rate); }
+
+	//! \brief Retrieve the download rate, in bytes/second
+	inline uint32_t getDownloadRate() const { return download_bucket.getRate(); }
+
+	/*! \brief Set the number of bytes every peer may send per round
+	 *
+	 *  Peers take turns sending, so this determines how finely the upload
+	 *  bandwidth is divided among them.
+	 */
+	inline void setSendQuantum(size_t quantum) { sender->setQuantum(quantum); }
+
+	//! \brief Retrieve the number of bytes every peer may send per round
+	inline size_t getSendQuantum() const { return sender->getQuantum(); }
 
 	//! \brief Retrieve our tracer object
 	Tracer* getTracer() { return tracer; } 
@@ -90,8 +116,13 @@ protected:
 	//! \brief Seperate thread handling torrent silicon heartbeat
 	void overseerThread();
 
-	//! \brief Handles a new incoming socket
-	void handleIncomingConnection(Connection* c);
+	/*! \brief Handles a new incoming socket
+	 *  \param c Connection, which will be owned by the overseer
+	 *  \param handshake First part of the handshake, everything but the peer ID
+	 *
+	 *  The peer ID is handled by the peer itself once it arrives.
+	 */
+	void handleIncomingConnection(Connection* c, const uint8_t* handshake);
 
 	//! \brief Retrieve the incoming socket
 	Connection* getIncoming() { return incoming; }
@@ -99,6 +130,9 @@ protected:
 	//! \brief Retrieve the callback handler
 	Callbacks* getCallbacks() { return callbacks; }
 
+	//! \brief Retrieve the receiver responsible for a file descriptor
+	Receiver* getReceiver(int fd) const { return receivers[fd % receivers.size()]; }
+
 	/*
  	 * All functions below here are designed to honor the
 	 * principe of least knowledge; all they do is simply
@@ -107,16 +141,34 @@ protected:
 
 	/** Hasher **/
 
-	//! \brief Request hashing of a piece
-	void queueHashPiece(Torrent* t, uint32_t piece);
+	/*! \brief Request hashing of a piece
+	 *  \param t Torrent the piece belongs to
+	 *  \param piece Piece to hash
+	 *  \param recheck Is this a recheck of existing data?
+	 */
+	void queueHashPiece(Torrent* t, uint32_t piece, bool recheck = false);
 
 	//! \brief Cancels any hashing scheduled for a torrent
 	void cancelHashing(Torrent* t);
 
 	/** Sender **/
 
-	//! \brief Used to signal a sender
-	void signalSender();
+	//! \brief Used to signal the sender that a peer has something to send
+	void signalSender(int fd);
+
+	//! \brief Used to tell the sender a peer is going away
+	void removeSenderPeer(int fd);
+
+	/** ConnectionManager **/
+
+	//! \brief Queue a connection attempt to a peer
+	void connectPeer(PendingPeer* pp);
+
+	//! \brief Cancels any connection attempts scheduled for a torrent
+	void cancelConnecting(Torrent* t);
+
+	//! \brief Signal that a half-open connection is done
+	void connectionDone();
 
 	/** Receiver **/
 
@@ -138,9 +190,6 @@ protected:
 	//! \brief Find a peer by file descriptor and remove it
 	void removePeerByFD(int fd);
 
-	//! \brief Request a map of file descriptor for sending
-	void getSendablePeers(std::list<int>& m);
-
 	/** FileManager **/
 
 	//! \brief Adds a file to the list of files
@@ -155,6 +204,12 @@ protected:
 	//! \brief Read from a file
 	void readFile(File* f, off_t offset, void* buf, size_t len);
 
+	//! \brief Send a part of a file to a socket
+	ssize_t sendFile(File* f, int sockfd, off_t offset, size_t len);
+
+	//! \brief Start reading a part of a file in the background
+	void prefetchFile(File* f, off_t offset, size_t len);
+
 private:
 	//! \brief Info hash to torrent mappings
 	std::map<std::string, Torrent*> torrents;
@@ -180,20 +235,27 @@ private:
 	//! \brief Sender object used for all torrents
 	Sender* sender;
 
-	//! \brief Receiver object used for all torrents
-	Receiver* receiver;
+	/*! \brief Receiver objects used for all torrents
+	 *
+	 *  Every file descriptor is handled by exactly one receiver, as picked
+	 *  by getReceiver(). The first receiver also handles incoming connections.
+	 */
+	std::vector<Receiver*> receivers;
 
-	//! \brief Hasher thread
+	//! \brief Hasher threads
 	Hasher* hasher;
 
+	//! \brief Connection manager, used to set up outgoing connections
+	ConnectionManager* connectionmanager;
+
 	//! \brief Overseer thread
 	boost::thread* thread;
 
-	/*! \brief Upload rate, in bytes/second
-	 *
-	 *  Zero indicates unlimited.
-	 */
-	uint32_t upload_rate;
+	//! \brief Limits the upload rate of all torrents combined
+	TokenBucket upload_bucket;
+
+	//! \brief Limits the download rate of all torrents combined
+	TokenBucket download_bucket;
 
 	//! \brief Tracer object used
 	Tracer* tracer;
@@ -1,10 +1,15 @@
 #include <boost/thread/mutex.hpp>
-#include <boost/thread/shared_mutex.hpp>
+#include <sys/uio.h>
 #include <list>
+#include <map>
+#include <set>
 #include <stdint.h>
 #include <string>
 #include <vector>
+#include "bitfield.h"
 #include "connection.h"
+#include "mpscqueue.h"
+#include "tokenbucket.h"
 
 #ifndef __TORTILLA_PEER_H__
 #define __TORTILLA_PEER_H__
@@ -19,18 +24,41 @@ class Receiver;
 //! \brief This is the number of requests we attempt to keep on the wire
 #define PEER_MAX_OUTSTANDING_REQUESTS	20
 
+/*! \brief Number of seconds worth of data we keep requested if rate limited
+ *
+ *  Requesting more than we are willing to receive only makes data pile up
+ *  at the peer, and makes it take longer for requests to be fulfilled.
+ */
+#define PEER_REQUEST_BACKLOG_TIME	2
+
 //! \brief Amount of seconds that must pass before we snub a peer
 #define PEER_SNUBBED_SECONDS 30
 
 //! \brief Amount of seconds that must pass become we kick a peer
 #define PEER_KICK_SECONDS 120
 
+//! \brief Amount of seconds an outgoing connection may take to be established
+#define PEER_CONNECT_TIMEOUT 10
+
+/*! \brief Number of queued piece uploads to read ahead
+ *
+ *  The data of these requests is read from disk in the background, so it is
+ *  available once we get to send it.
+ */
+#define PEER_UPLOAD_READAHEAD 4
+
+//! \brief Maximum number of queued messages to send using a single system call
+#define PEER_MAX_GATHER 64
+
 /*! \brief Length of the buffer used to cache incomplete commands
  *
  *  This should be 2 * max command length.
  */
 #define PEER_BUFFER_SIZE		(131072)
 
+//! \brief Maximum length of a message; anyone sending more is disconnected
+#define PEER_MAX_MESSAGE_LENGTH	(65536)
+
 #define PEER_PSTR "BitTorrent protocol"
 
 #define PEER_MSGID_CHOKE		0x0
@@ -57,6 +85,14 @@ public:
 		       length == r.getLength();
 	}
 
+	bool operator < (OutstandingChunkRequest r) const {
+		if (piece != r.getPiece())
+			return piece < r.getPiece();
+		if (offset != r.getOffset())
+			return offset < r.getOffset();
+		return length < r.getLength();
+	}
+
 	unsigned int getPiece() const { return piece; }
 	unsigned int getOffset() const { return offset; }
 	unsigned int getLength() const { return length; }
@@ -93,13 +129,23 @@ public:
 	//! \brief Retrieve the file descriptor associated with this peer
 	inline int getFD() const { return connection->getFD(); }
 
+	/*! \brief Retrieve the free parts of the receive buffer
+	 *  \param iov Receives the buffers, must have room for 2 entries
+	 *  \returns Number of buffers, zero if the buffer is full
+	 *
+	 *  Data can be read directly into these buffers, after which receive()
+	 *  must be called.
+	 */
+	int getReceiveBuffers(struct iovec* iov);
+
 	/*! \brief Called if data is received for this peer
+	 *  \param data_len Number of bytes placed in the receive buffers
 	 *  \returns true if the connection must be severed
 	 */
-	bool receive(const uint8_t* data, uint32_t data_len);
+	bool receive(uint32_t data_len);
 
 	//! \brief Retrieve the piece map of the peer
-	const std::vector<bool>& getPieceMap() const { return havePiece; }
+	const Bitfield& getPieceMap() const { return havePiece; }
 
 	//! \brief Retrieve the peer ID
 	const std::string& getPeerID() const { return peerID; }
@@ -132,6 +178,16 @@ public:
 	//! \brief Retrieves the average send/transmit rate, in bytes/second
 	void getAverageRate(uint32_t* rx, uint32_t* tx);
 
+	/*! \brief Set the upload rate to this peer, in bytes/second
+	 *
+	 *  An upload rate of zero indicates only the torrent's and overseer's
+	 *  limits apply.
+	 */
+	void setUploadRate(uint32_t rate) { upload_bucket.setRate(rate); }
+
+	//! \brief Retrieve the upload rate to this peer, in bytes/second
+	uint32_t getUploadRate() const { return upload_bucket.getRate(); }
+
 	//! \brief Must be called every second
 	void timer();
 
@@ -195,8 +251,18 @@ public:
 	//! \brief Signal that we finished connecting
 	void connectionDone();
 
-	/*! \brief Cancel a request for a certain chunk in a piece */
-	void cancelChunk(uint32_t piece, uint32_t offset, uint32_t len);
+	/*! \brief Cancel a request for a certain chunk in a piece
+	 *  \return true if the chunk was requested from this peer
+	 *
+	 *  The caller must inform the torrent that the request is done.
+	 */
+	bool cancelChunk(uint32_t piece, uint32_t offset, uint32_t len);
+
+	/*! \brief Have we requested a given chunk from this peer?
+	 *  \param piece Piece number
+	 *  \param offset Offset within the piece
+	 */
+	bool isRequestingChunk(uint32_t piece, uint32_t offset);
 
 protected:
 	//! \brief Handles a 'choke' message
@@ -230,12 +296,59 @@ protected:
 	void queueSenderRequest(SenderRequest* sr);
 
 	/*! \brief Processes the first sender requeue item
-	 *  \param max_length Maximum number of bytes to send, zero for unlimited
+	 *  \param max_length Maximum number of bytes to send, -1 for unlimited
+	 *  \param would_block Set if the socket couldn't take any more data
+	 *  \param drained Set if there is nothing left to send
 	 *  \returns Number of bytes transmitted
 	 *
 	 *  If the result had to be split, the resulting request will be modified.
+	 *  The bytes sent are taken from the peer's and torrent's upload buckets.
+	 */
+	size_t processSenderQueue(ssize_t max_length, bool& would_block, bool& drained);
+
+	/*! \brief Retrieve how many bytes may be uploaded to this peer
+	 *  \param delay Set to the number of microseconds until we may upload
+	 *  \returns Number of bytes, or -1 if unlimited
+	 *
+	 *  This takes the peer's and the torrent's upload limits into account; the
+	 *  delay is only updated if zero is returned.
+	 */
+	ssize_t getUploadAllowance(uint64_t& delay);
+
+	/*! \brief Sends (a part of) a number of requests to the peer
+	 *  \param requests Requests to send, in order
+	 *  \param max_length Maximum number of bytes to send, or -1 for unlimited
+	 *  \returns Number of bytes sent, or -1 on error
+	 *
+	 *  Only the final request may have data that isn't in memory.
+	 */
+	ssize_t sendRequests(const std::vector<SenderRequest*>& requests, ssize_t max_length);
+
+	/*! \brief Adds an upload to the bulk queue
+	 *  \param sr Request to add
+	 *  \param front Should the request be sent before all others?
 	 */
-	size_t processSenderQueue(ssize_t max_length);
+	void queueUpload(SenderRequest* sr, bool front);
+
+	//! \brief Removes the first upload from the bulk queue and returns it
+	SenderRequest* dequeueUpload();
+
+	/*! \brief Removes an upload from the bulk queue
+	 *  \return Iterator to the next upload in the queue
+	 *
+	 *  The request itself is left alone.
+	 */
+	std::list<SenderRequest*>::iterator removeUpload(std::list<SenderRequest*>::iterator it);
+
+	/*! \brief Sorts newly queued requests into the control and bulk queues
+	 *
+	 *  Cancellations and chokes are applied to the queued uploads here. Must
+	 *  only be called by the sender, with mtx_sending held.
+	 */
+	void fetchSenderRequests();
+
+	//! \brief Starts reading the data of the first few queued uploads
+	void prefetchUploads();
 
 	/*! \brief Cancel request for a chunk
 	 *  \param piece Piece number to cancel
@@ -244,7 +357,7 @@ protected:
 	 */
 	void cancelChunkRequest(unsigned int piece, unsigned int offset, unsigned int length);
 
-	//! \brief Do we have something to send?
+	//! \brief Do we have something to send? Must only be called by the sender
 	bool isSenderQueueEmpty();
 
 	//! \brief Process
@@ -268,6 +381,13 @@ protected:
 	 */
 	int sendPieceRequest(unsigned int piece);
 
+	/*! \brief Retrieve the number of requests we may keep on the wire
+	 *
+	 *  This is PEER_MAX_OUTSTANDING_REQUESTS, unless a download limit applies
+	 *  which can't keep up with that many.
+	 */
+	unsigned int getMaxOutstandingRequests() const;
+
 	//! \brief Locks a peer for sending
 	void lockForSending();
 
@@ -280,6 +400,9 @@ private:
 	 */
 	void __init(Torrent* t);
 
+	//! \brief Remove data from the front of the command buffer
+	void consumeCommandBuffer(uint32_t len);
+
 	//! \brief Construct a request
 	std::string constructRequest(uint32_t index, uint32_t begin, uint32_t length);
 
@@ -298,8 +421,11 @@ private:
 	//! \brief Are we waiting for the protocol handshake?
 	bool handshaking;
 
+	//! \brief Are we waiting for the peer ID of an incoming connection?
+	bool awaiting_peerid;
+
 	//! \brief Which pieces does this peer have?
-	std::vector<bool> havePiece;
+	Bitfield havePiece;
 
 	//! \brief ID of the peer
 	std::string peerID;
@@ -310,18 +436,29 @@ private:
 	//! \brief Connection to the peer
 	Connection* connection;
 
-	//! \brief Current command buffer
-	uint8_t command_buffer[PEER_BUFFER_SIZE];
+	/*! \brief Current command buffer
+	 *
+	 *  This is a ring buffer of PEER_BUFFER_SIZE bytes, followed by slack
+	 *  space; messages that wrap around have their wrapped part copied there,
+	 *  so that they can be handled sequentially.
+	 */
+	uint8_t command_buffer[PEER_BUFFER_SIZE + PEER_MAX_MESSAGE_LENGTH];
 
-	//! \brief Number of bytes in the command buffer
+	//! \brief Read and write positions in the command buffer
 	uint32_t command_buffer_readpos, command_buffer_writepos;
 
+	//! \brief Number of bytes in the command buffer
+	uint32_t command_buffer_len;
+
 	//! \brief Amount of data sent / recieved during the last cycle
 	uint32_t tx_bytes, rx_bytes;
 
 	//! \brief Amount of data sent / received during the peers lifetime
 	uint64_t tx_total, rx_total;
 
+	//! \brief Limits the upload rate to this peer
+	TokenBucket upload_bucket;
+
 	//! \brief Timestamp of peer launch
 	time_t launchTime;
 
@@ -331,6 +468,13 @@ private:
 	//! \brief Total number of pieces this peer has
 	unsigned int numPeerPieces;
 
+	/*! \brief Number of pieces this peer has which we lack
+	 *
+	 *  We are interested in the peer as long as this isn't zero. This is
+	 *  protected by the data mutex of the torrent, as is our piece map.
+	 */
+	unsigned int numWantedPieces;
+
 	//! \brief Is this peer terminating?
 	bool terminating;
 
@@ -338,10 +482,32 @@ private:
 	bool incoming;
 
 	//! \brief Chunks we are currently requesting
-	std::list<OutstandingChunkRequest> chunk_requests;
+	std::set<OutstandingChunkRequest> chunk_requests;
+
+	/*! \brief Control messages that need to be sent
+	 *
+	 *  These are always sent before anything in the bulk queue, so that
+	 *  for example our requests aren't held up by our uploads.
+	 */
+	std::list<SenderRequest*> control_queue;
 
-	//! \brief Requests that need to be sent
-	std::list<SenderRequest*> send_queue;
+	//! \brief Piece uploads that need to be sent
+	std::list<SenderRequest*> bulk_queue;
+
+	/*! \brief Piece uploads in the bulk queue, by piece and offset
+	 *
+	 *  This allows cancelling an upload without walking the queue. It is
+	 *  maintained alongside the bulk queue, and thus only touched by the sender.
+	 */
+	std::multimap<std::pair<uint32_t, uint32_t>, std::list<SenderRequest*>::iterator> upload_index;
+
+	/*! \brief Requests queued by anyone, not yet seen by the sender
+	 *
+	 *  Only the sender takes requests from here, and sorts them into the
+	 *  control and bulk queues. These are thus only touched by the sender,
+	 *  while holding mtx_sending, and need no lock of their own.
+	 */
+	MPSCQueue send_inbox;
 
 	//! \brief Mutex protecting the peer data
 	boost::mutex mtx_data;
@@ -353,9 +519,6 @@ private:
 	 *  until it's gone.
 	 */
 	boost::mutex mtx_sending;
-
-	//! \brief Mutex protecting the queue
-	boost::shared_mutex rwl_send_queue;
 };
 
 //! \brief Helper object, used to determine whether a peer matches
@@ -0,0 +1,74 @@
+#include <stdint.h>
+#include <time.h>
+#include "connection.h"
+#include "peer.h"
+#include "torrent.h"
+
+#ifndef __TORTILLA_PENDINGHANDSHAKE_H__
+#define __TORTILLA_PENDINGHANDSHAKE_H__
+
+namespace Tortilla {
+
+/*! \brief Length of the first part of the handshake
+ *
+ *  This consists of everything but the peer id; it is all we need to know
+ *  which torrent the connection is for.
+ */
+#define PENDINGHANDSHAKE_LENGTH	(1 + (sizeof(PEER_PSTR) - 1) + 8 + TORRENT_HASH_LEN)
+
+/*! \brief Implements an incoming connection awaiting its handshake
+ *
+ *  Accepted connections are kept here until the first part of the handshake
+ *  has been received; this is read as it comes in, so that a slow peer
+ *  doesn't stall anyone else.
+ */
+class PendingHandshake {
+public:
+	/*! \brief Constructs a pending handshake
+	 *  \param c Accepted connection; will be owned by this object
+	 *  \param timeout Number of seconds the peer has to send the handshake
+	 */
+	PendingHandshake(Connection* c, unsigned int timeout);
+
+	//! \brief Destroys the pending handshake, closing the connection if still owned
+	~PendingHandshake();
+
+	/*! \brief Reads any available handshake data
+	 *  \returns true if the connection must be dropped
+	 */
+	bool receive();
+
+	//! \brief Has the entire first part of the handshake been received?
+	bool isComplete() const { return received == PENDINGHANDSHAKE_LENGTH; }
+
+	//! \brief Has the peer run out of time?
+	bool isExpired(time_t now) const { return now >= deadline; }
+
+	//! \brief Retrieve the handshake data
+	const uint8_t* getHandshake() const { return handshake; }
+
+	//! \brief Retrieve the connection
+	Connection* getConnection() const { return connection; }
+
+	/*! \brief Relinquish ownership of the connection
+	 *  \returns The connection
+	 */
+	Connection* releaseConnection();
+
+private:
+	//! \brief Connection we are waiting on
+	Connection* connection;
+
+	//! \brief Time at which we give up on the peer
+	time_t deadline;
+
+	//! \brief Handshake received so far
+	uint8_t handshake[PENDINGHANDSHAKE_LENGTH];
+
+	//! \brief Number of bytes of the handshake received
+	unsigned int received;
+};
+
+}
+
+#endif /* __TORTILLA_PENDINGHANDSHAKE_H__ */
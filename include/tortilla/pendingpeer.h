@@ -21,10 +21,15 @@ public:
 	 *  \returns A Peer object
 	 *
 	 *  The new peer will be connecting to the endpoint, handing it off to
-	 *  the torrent peer list will be fine.
+	 *  the torrent peer list will be fine. This may block while resolving
+	 *  the peer's hostname, so it should only be called by the
+	 *  ConnectionManager.
 	 */
 	Peer* connect();
 
+	//! \brief Retrieve the torrent the peer is bound to
+	Torrent* getTorrent() const { return torrent; }
+
 private:
 	//! \brief Torrent object the peer is bound to
 	Torrent* torrent;
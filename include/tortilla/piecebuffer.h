@@ -0,0 +1,116 @@
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+#include <vector>
+#include "sha1.h"
+
+#ifndef __TORTILLA_PIECEBUFFER_H__
+#define __TORTILLA_PIECEBUFFER_H__
+
+namespace Tortilla {
+
+/*! \brief Holds a piece while it is being downloaded
+ *
+ *  Chunks are stored here as they arrive; once the piece is complete, it is
+ *  hashed from memory and written to the output files in one go.
+ *
+ *  As chunks tend to arrive in order, the hash is updated as soon as the
+ *  start of the piece is contiguous; if all chunks arrive in order, the hash
+ *  is known the moment the final chunk arrives. Only one thread at a time
+ *  holds the hasher, and it does the hashing without holding the lock of
+ *  the torrent.
+ *
+ *  Everything but the data itself is protected by the data lock of the
+ *  torrent; a chunk's data is only written once, before it is marked as
+ *  stored.
+ */
+class PieceBuffer {
+public:
+	/*! \brief Constructs a new, empty piece buffer
+	 *  \param len Length of the piece, in bytes
+	 */
+	PieceBuffer(uint32_t len);
+
+	//! \brief Destroys the piece buffer
+	~PieceBuffer();
+
+	/*! \brief Store a chunk
+	 *  \param offset Byte offset within the piece, must be chunk-aligned
+	 *  \param data Chunk data
+	 *  \param len Length of the chunk
+	 */
+	void store(uint32_t offset, const uint8_t* data, uint32_t len);
+
+	/*! \brief Try to claim the hasher
+	 *  \returns true if the caller must call hash()
+	 *
+	 *  This succeeds if nobody holds the hasher and the chunk following the
+	 *  hashed part is stored.
+	 */
+	bool claimHasher();
+
+	/*! \brief Hash the stored chunks following the hashed part
+	 *  \param lock Data lock of the torrent, released while hashing
+	 *
+	 *  May only be called by the holder of the hasher, which is released once
+	 *  there is nothing left to hash.
+	 */
+	void hash(boost::unique_lock<boost::mutex>& lock);
+
+	//! \brief Is someone hashing the piece?
+	bool isHashing() const { return hashing; }
+
+	/*! \brief Leave completing the piece to the holder of the hasher
+	 *
+	 *  Used when the piece is complete while the final chunks are still being
+	 *  hashed; the buffer must be kept until the hasher is done.
+	 */
+	void setPendingComplete() { pendingComplete = true; }
+
+	//! \brief Must the holder of the hasher complete the piece?
+	bool isPendingComplete() const { return pendingComplete; }
+
+	//! \brief Has the entire piece been hashed?
+	bool isHashed() const { return hashed == length; }
+
+	//! \brief Retrieve the number of bytes at the start of the piece that are hashed
+	uint32_t getHashedLength() const { return hashed; }
+
+	/*! \brief Retrieve the hasher
+	 *
+	 *  This has processed getHashedLength() bytes of the piece.
+	 */
+	HashSHA1& getHasher() { return sha1; }
+
+	//! \brief Retrieve the piece data
+	const uint8_t* getData() const { return data; }
+
+	//! \brief Retrieve the length of the piece
+	uint32_t getLength() const { return length; }
+
+private:
+	//! \brief Piece data
+	uint8_t* data;
+
+	//! \brief Length of the piece
+	uint32_t length;
+
+	//! \brief Which chunks have been stored?
+	std::vector<bool> haveChunk;
+
+	//! \brief Number of bytes processed by the hasher
+	uint32_t hashed;
+
+	//! \brief Does anyone hold the hasher?
+	bool hashing;
+
+	//! \brief Must the holder of the hasher complete the piece?
+	bool pendingComplete;
+
+	//! \brief Hasher, fed with the piece as it becomes contiguous
+	HashSHA1 sha1;
+};
+
+}
+
+#endif /* __TORTILLA_PIECEBUFFER_H__ */
@@ -0,0 +1,95 @@
+#include <set>
+#include <vector>
+#include "bitfield.h"
+
+#ifndef __TORTILLA_PIECEPICKER_H__
+#define __TORTILLA_PIECEPICKER_H__
+
+namespace Tortilla {
+
+/*! \brief Number of pieces we pick at random before going for the rarest
+ *
+ *  The rarest pieces are usually only available from a few peers, so they
+ *  take a while to come in; we need something to trade quickly first.
+ */
+#define PIECEPICKER_RANDOM_FIRST 4
+
+/*! \brief Decides which pieces to request first
+ *
+ *  Pieces we still need are kept in buckets by the number of peers that have
+ *  them, so the rarest pieces can be found without looking at every piece.
+ *  Pieces end up in random order within their bucket, which prevents peers
+ *  from all going after the same pieces.
+ *
+ *  Partially downloaded pieces always come first, as these can only be
+ *  shared once they are complete.
+ *
+ *  This class does no locking on its own.
+ */
+class PiecePicker {
+public:
+	/*! \brief Constructs a new piece picker
+	 *  \param num Number of pieces in the torrent
+	 *
+	 *  Initially, all pieces are wanted and no peer has any of them.
+	 */
+	PiecePicker(unsigned int num);
+
+	//! \brief Called when a peer has announced it has a piece
+	void addAvailability(unsigned int piece);
+
+	//! \brief Called when a peer that had a piece goes away
+	void removeAvailability(unsigned int piece);
+
+	//! \brief Retrieve the number of peers that have a piece
+	unsigned int getAvailability(unsigned int piece) const;
+
+	/*! \brief Change whether we need a piece
+	 *
+	 *  A piece that is no longer wanted is no longer partial either.
+	 */
+	void setWanted(unsigned int piece, bool wanted);
+
+	//! \brief Do we need a given piece?
+	bool isWanted(unsigned int piece) const;
+
+	//! \brief Change whether a piece is being downloaded
+	void setPartial(unsigned int piece, bool partial);
+
+	/*! \brief Pick pieces to request from a peer
+	 *  \param have Pieces the peer has
+	 *  \param exclude Pieces that must not be picked
+	 *  \param pieces Receives the pieces, most preferred first
+	 *  \param max Maximum number of pieces to pick
+	 */
+	void pick(const Bitfield& have, const std::set<unsigned int>& exclude, std::vector<unsigned int>& pieces, unsigned int max) const;
+
+private:
+	//! \brief Place a piece in the bucket matching its availability
+	void insertPiece(unsigned int piece);
+
+	//! \brief Remove a piece from its bucket
+	void removePiece(unsigned int piece);
+
+	//! \brief Number of pieces in the torrent
+	unsigned int numPieces;
+
+	//! \brief Number of pieces we need
+	unsigned int numWanted;
+
+	//! \brief Number of peers having each piece
+	std::vector<unsigned int> availability;
+
+	//! \brief Pieces we need, by the number of peers having them
+	std::vector<std::vector<unsigned int> > buckets;
+
+	//! \brief Index of each piece within its bucket, if we need it
+	std::vector<unsigned int> position;
+
+	//! \brief Pieces that are being downloaded
+	std::set<unsigned int> partial;
+};
+
+}
+
+#endif /* __TORTILLA_PIECEPICKER_H__ */
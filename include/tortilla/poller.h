@@ -0,0 +1,99 @@
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <vector>
+
+#ifndef __TORTILLA_POLLER_H__
+#define __TORTILLA_POLLER_H__
+
+namespace Tortilla {
+
+//! \brief Wake up if the file descriptor can be read from
+#define POLLER_READ	0x0001
+
+//! \brief Wake up if the file descriptor can be written to
+#define POLLER_WRITE	0x0002
+
+//! \brief File descriptor is in error or hung up (reported only)
+#define POLLER_ERROR	0x0004
+
+/*! \brief Only report events once the file descriptor becomes ready
+ *
+ *  The caller is expected to use the descriptor until it would block, and
+ *  then call modify() to wait for the next edge. Without epoll(7), the
+ *  descriptor is not monitored anymore once reported until modify() is called.
+ */
+#define POLLER_EDGE	0x0008
+
+//! \brief Maximum number of events handed out by a single wait()
+#define POLLER_MAX_EVENTS	256
+
+//! \brief A single event reported by the poller
+class PollerEvent {
+public:
+	PollerEvent(int f, unsigned int e) {
+		fd = f; events = e;
+	}
+
+	//! \brief File descriptor the event belongs to
+	int fd;
+
+	//! \brief POLLER_... flags that were triggered
+	unsigned int events;
+};
+
+/*! \brief Monitors a set of file descriptors for events
+ *
+ *  On Linux, this uses epoll(7) so that interest is registered once and
+ *  waiting costs O(events) instead of O(descriptors); other systems use a
+ *  poll(2)-based fallback. All functions may be called from any thread.
+ */
+class Poller {
+public:
+	//! \brief Constructs a new, empty poller
+	Poller();
+
+	//! \brief Destroys the poller; monitored descriptors are not closed
+	~Poller();
+
+	/*! \brief Start monitoring a file descriptor
+	 *  \param fd File descriptor to monitor
+	 *  \param events POLLER_... events we are interested in
+	 */
+	void add(int fd, unsigned int events);
+
+	/*! \brief Change the events we are interested in
+	 *  \param fd File descriptor to change
+	 *  \param events New POLLER_... events we are interested in
+	 */
+	void modify(int fd, unsigned int events);
+
+	/*! \brief Stop monitoring a file descriptor
+	 *
+	 *  This must be called before the descriptor is closed. Removing a
+	 *  descriptor that isn't monitored is harmless.
+	 */
+	void remove(int fd);
+
+	/*! \brief Wait until events arrive
+	 *  \param events Receives the events that triggered
+	 *  \param timeout Maximum time to wait, in milliseconds
+	 *  \returns Number of events, zero on timeout
+	 */
+	int wait(std::vector<PollerEvent>& events, int timeout);
+
+private:
+#ifdef __linux__
+	//! \brief epoll(7) file descriptor
+	int epfd;
+#else
+	//! \brief Descriptors and the events we are interested in
+	std::map<int, unsigned int> interest;
+
+	//! \brief Mutex protecting the interest map
+	boost::mutex mtx_data;
+#endif
+};
+
+}
+
+#endif /* __TORTILLA_POLLER_H__ */
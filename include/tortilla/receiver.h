@@ -2,7 +2,9 @@
 #include <boost/thread/shared_mutex.hpp>
 #include <list>
 #include <map>
+#include <vector>
 #include "file.h"
+#include "poller.h"
 
 #ifndef __TORTILLA_RECEIVER_H__
 #define __TORTILLA_RECEIVER_H__
@@ -12,15 +14,34 @@ namespace Tortilla {
 class Overseer;
 class Peer;
 class HTTPRequest;
+class PendingHandshake;
+
+/*! \brief Maximum time the receiver waits for events, in milliseconds
+ *
+ *  Peers that are shutting down are only removed once this expires or
+ *  other events arrive.
+ */
+#define RECEIVER_POLL_TIMEOUT	100
+
+//! \brief Number of seconds an incoming connection has to send its handshake
+#define RECEIVER_HANDSHAKE_TIMEOUT	3
+
+/*! \brief Maximum number of incoming connections awaiting their handshake
+ *
+ *  Any connections beyond this are closed immediately after accepting.
+ */
+#define RECEIVER_MAX_PENDING_HANDSHAKES	64
 
 /*! \brief Handles receiver of data to peers / torrents
  *
- *  This object will also keep track of all peers that are known to any
- *  torrent; this includes handling incoming data and passing it to the
- *  appropriate peer and closing of a connection.
+ *  This object will also keep track of the peers assigned to it; this
+ *  includes handling incoming data and passing it to the appropriate peer
+ *  and closing of a connection. The overseer runs several receivers and
+ *  assigns every peer to exactly one of them, so that incoming data is
+ *  handled by multiple threads without a lock shared between them.
  *
  *  The use of this object greatly simplifies locking,
- *  since because it keeps track of all peers, it can safely
+ *  since because it keeps track of all its peers, it can safely
  *  decide once it's safe to remove any.
  */
 class Receiver {
@@ -28,8 +49,9 @@ friend	void* receiver_thread(void* ptr);
 public:
 	/*! \brief Constructs a new downloader
 	 *  \param o Overseer object to use
+	 *  \param listen Whether we handle the incoming connection socket
 	 */
-	Receiver(Overseer* o);
+	Receiver(Overseer* o, bool listen);
 
 	/*! \brief Destroys the downloader
 	 *
@@ -64,10 +86,30 @@ public:
 	//! \brief Find a peer by file descriptor and remove it
 	void removePeerByFD(int fd);
 
-	//! \brief Request a map of file descriptor for sending
-	void getSendablePeers(std::list<int>& m) const;
-
 private:
+	//! \brief Accepts incoming connections and waits for their handshake
+	void acceptConnections();
+
+	/*! \brief Handles data for a connection awaiting its handshake
+	 *  \returns true if the handshake is complete
+	 */
+	bool processHandshake(PendingHandshake* ph);
+
+	//! \brief Drops any connections that failed to handshake in time
+	void expireHandshakes();
+
+	/*! \brief Retrieve how many bytes may be read from a peer
+	 *  \param delay Set to the number of microseconds until we may read
+	 *  \returns Number of bytes, or -1 if unlimited
+	 *
+	 *  This takes the torrent's and overseer's download limits into account; the
+	 *  delay is only updated if zero is returned.
+	 */
+	ssize_t getDownloadAllowance(Peer* p, uint64_t& delay);
+
+	//! \brief Start reading from peers that were throttled again
+	void resumeThrottled();
+
 	//! \brief Our overseer object
 	Overseer* overseer;
 
@@ -77,12 +119,39 @@ private:
 	//! \brief Peers managed by us
 	std::list<Peer*> /* [M=peers] */ peers;
 
-	//! \brief Outstanding HTTP requests
-	std::list<HTTPRequest*> requests;
+	//! \brief Outstanding HTTP requests, by file descriptor
+	std::map<int, HTTPRequest*> requests;
 
 	//! \brief Hash used to map file descriptors -> peers
 	std::map<int, Peer*> fdMap;
 
+	/*! \brief Incoming connections awaiting their handshake, by file descriptor
+	 *
+	 *  This is only touched by our own thread, and thus needs no locking.
+	 */
+	std::map<int, PendingHandshake*> handshakes;
+
+	/*! \brief Peers we stopped reading from, by file descriptor
+	 *
+	 *  These have exhausted a download limit; their data is left in the
+	 *  socket, so that the peer is held back by TCP flow control. This is only
+	 *  touched by our own thread, and thus needs no locking.
+	 */
+	std::vector<int> throttled;
+
+	//! \brief Time at which we try reading from throttled peers again
+	uint64_t throttledUntil;
+
+	/*! \brief Monitors the peer, request and listener sockets
+	 *
+	 *  Interest is updated as peers and requests come and go, so that we
+	 *  never have to walk all of them to find out who has something to say.
+	 */
+	Poller poller;
+
+	//! \brief Do we accept incoming connections?
+	bool listening;
+
 	//! \brief Are we terminating?
 	bool terminating;
 
@@ -92,4 +161,4 @@ private:
 
 }
 
-#endif /* __TORTILLA_FILEMANAGER_H__ */
+#endif /* __TORTILLA_RECEIVER_H__ */
@@ -1,9 +1,10 @@
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
-#include <boost/thread/condition_variable.hpp>
-#include <queue>
+#include <map>
+#include <set>
 #include <stdint.h>
 #include "peer.h"
+#include "poller.h"
 #include "senderrequest.h"
 
 #ifndef __TORTILLA_SENDER_H__
@@ -13,10 +14,25 @@ namespace Tortilla {
 
 class Overseer;
 
+/*! \brief Default number of bytes every peer may send per round
+ *
+ *  This is a single piece message, including its header.
+ */
+#define SENDER_DEFAULT_QUANTUM	(TORRENT_CHUNK_SIZE + 13)
+
 /*! \brief Handles sending data to peers
  *
  *  This resides in a seperate thread to monitor the available bandwidth and
  *  gracefully deal with write timeouts risking blocking the torrent itself.
+ *
+ *  Peers are served using deficit round robin: every round, each peer may
+ *  send up to a quantum of bytes plus whatever it was unable to send in the
+ *  previous round. This splits the upload budget evenly among the peers.
+ *
+ *  Only peers that have something to send and whose socket can take it are
+ *  considered; peers tell us when they queue something, and the sockets tell
+ *  us once they can be written to again. If there is nothing to do, the
+ *  sender just sleeps.
  */
 class Sender {
 friend	void* sender_thread(void* ptr);
@@ -30,40 +46,91 @@ public:
 	//! \brief Destroys the uploader
 	~Sender();
 
-	/*! \brief Set the number of bytes we may upload this interval
-	 *
-	 *  Zero means anything goes.
-	 */
-	void setAmountTransferrable(uint32_t amount);
+	//! \brief Set the number of bytes every peer may send per round
+	void setQuantum(size_t q);
+
+	//! \brief Retrieve the number of bytes every peer may send per round
+	size_t getQuantum();
 
 protected:
 	//! \brief Handles processing of the queue
 	void process();
 
-	//! \brief Request the sender to process
-	void signal();
+	/*! \brief Request the sender to process a peer
+	 *  \param fd File descriptor of the peer which has something to send
+	 */
+	void signal(int fd);
+
+	/*! \brief Start monitoring a peer
+	 *
+	 *  Nothing will be sent to the peer until its socket is known to be
+	 *  writable.
+	 */
+	void addPeer(int fd);
+
+	//! \brief Stop monitoring a peer; must be called before the socket closes
+	void removePeer(int fd);
 
 private:
+	//! \brief Wake up the sender thread, if it isn't already being woken up
+	void wakeup();
+
 	//! \brief Mutex protecting our local data
 	boost::mutex mtx_data;
 
-	//! \brief Condition variable used to kick the sender
-	boost::condition_variable cv;
-
 	//! \brief Are we terminating?
 	bool terminating;
 
-	/*! \brief Number of bytes allowed to be transfered
+	//! \brief Monitors the peer sockets for writability, and our wakeup pipe
+	Poller poller;
+
+	//! \brief Pipe used to wake up the sender thread
+	int wakeup_pipe[2];
+
+	/*! \brief Has the wakeup pipe been written to?
 	 *
 	 *  This is protected by mtx_data.
 	 */
-	uint32_t tx_left;
+	bool wakeup_pending;
+
+	/*! \brief Peers we know of, by file descriptor
+	 *
+	 *  This is protected by mtx_data.
+	 */
+	std::set<int> peers;
+
+	/*! \brief Peers that have something to send, by file descriptor
+	 *
+	 *  This is protected by mtx_data.
+	 */
+	std::set<int> pending;
+
+	/*! \brief Peers whose socket can't be written to, by file descriptor
+	 *
+	 *  This is protected by mtx_data.
+	 */
+	std::set<int> blocked;
+
+	/*! \brief Number of bytes every peer may send per round
+	 *
+	 *  This is protected by mtx_data.
+	 */
+	size_t quantum;
+
+	/*! \brief Number of bytes each peer is still owed, by file descriptor
+	 *
+	 *  This is only touched by our own thread, and thus needs no locking.
+	 */
+	std::map<int, size_t> deficits;
+
+	//! \brief File descriptor of the last peer that got its turn
+	int last_fd;
 
 	//! \brief Overseer object we belong to
 	Overseer* overseer;
 
 	//! \brief Thread used by the uploader
-	boost::thread thread;
+	boost::thread* thread;
 };
 
 }
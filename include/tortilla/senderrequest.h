@@ -1,12 +1,17 @@
 #include <string>
+#include "mpscqueue.h"
 
 #ifndef __TORTILLA_SENDERREQUEST_H__
 #define __TORTILLA_SENDERREQUEST_H__
 
 namespace Tortilla {
 
-/*! \brief A message to be sent */
-class SenderRequest {
+/*! \brief A message to be sent
+ *
+ *  Requests are handed to the sender using the peer's MPSCQueue; some
+ *  requests carry instructions for the sender rather than data.
+ */
+class SenderRequest : public MPSCNode {
 public:
 	//! \brief Construct a new request to upload a piece
 	SenderRequest(Torrent* t, uint32_t piece, uint32_t begin, uint32_t len);
@@ -29,6 +34,19 @@ public:
 	//! \brief Retrieve the number of bytes to upload
 	const uint32_t getMessageLength() const;
 
+	/*! \brief Retrieve the number of bytes to upload from getMessage()
+	 *
+	 *  For piece uploads, only the message header is kept in memory; the
+	 *  remainder must be sent from the torrent's files.
+	 */
+	const uint32_t getMemoryLength() const;
+
+	/*! \brief Retrieve the offset within the piece to upload from
+	 *
+	 *  This takes any bytes already uploaded into account.
+	 */
+	const uint32_t getUploadOffset() const;
+
 	//! \brief Retrieves the piece to download
 	const uint32_t getPiece() const { return piece; }
 
@@ -39,7 +57,7 @@ public:
 	const uint32_t getPieceLength() const { return piece_length; }
 
 	//! \brief Is this a request to send data?
-	const bool haveData() const { return (message == NULL); }
+	const bool haveData() const { return piece_length > 0; }
 
 	//! \brief Is this request partial?
 	bool isPartialRequest() const { return skip_num > 0; }
@@ -47,20 +65,55 @@ public:
 	//! \brief Skip a specific number of bytes
 	void skip(uint32_t l) { skip_num += l; }
 
+	//! \brief Has the data to upload been prefetched?
+	bool isPrefetched() const { return prefetched; }
+
+	//! \brief Mark the data to upload as prefetched
+	void setPrefetched() { prefetched = true; }
+
+	/*! \brief Does this request cancel queued uploads?
+	 *
+	 *  Such a request is never sent; instead, any queued upload of the same
+	 *  chunk that hasn't been started yet is dropped.
+	 */
+	bool isCancelling() const { return cancelling; }
+
+	//! \brief Mark the request as cancelling queued uploads
+	void setCancelling() { cancelling = true; }
+
+	/*! \brief Does this request discard queued uploads?
+	 *
+	 *  Any upload queued before this request that hasn't been started yet
+	 *  is dropped.
+	 */
+	bool isDiscardingUploads() const { return discarding_uploads; }
+
+	//! \brief Mark the request as discarding queued uploads
+	void setDiscardingUploads() { discarding_uploads = true; }
+
 protected:
 	//! \brief Used to initialize the object
 	void __init(uint32_t len);
 
 private:
-	//! \brief Is the request cancelled?
-	bool cancelled;
+	//! \brief Does this request cancel queued uploads?
+	bool cancelling;
+
+	//! \brief Does this request discard queued uploads?
+	bool discarding_uploads;
 
 	//! \brief Number of bytes to upload
 	uint32_t length;
 
+	//! \brief Number of bytes in the message
+	uint32_t message_length;
+
 	//! \brief Number of bytes to skip when sending data
 	uint32_t skip_num;
 
+	//! \brief Has the data to upload been prefetched?
+	bool prefetched;
+
 	//! \brief Message to send
 	uint8_t* message;
 
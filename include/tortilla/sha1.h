@@ -48,6 +48,20 @@ public:
 	//! \brief Retrieves the chunk size used to calculate the hash
 	static size_t getChunkSize() { return 1024; }
 
+	/*! \brief Retrieves the name of the block implementation in use
+	 *
+	 *  By default, the fastest implementation supported by the CPU is used.
+	 */
+	static const char* getImplementation();
+
+	/*! \brief Select a block implementation
+	 *  \param name Name of the implementation, as per getImplementation()
+	 *  \returns true on success, false if unknown or unsupported by the CPU
+	 *
+	 *  This is intended for testing and benchmarking; it affects all hashers.
+	 */
+	static bool setImplementation(const char* name);
+
 private:
 	//! \brief Length of a SHA1 hash
 	static const int SHA1_DIGEST_LENGTH = 20;
@@ -58,18 +72,16 @@ private:
 	//! \brief Computed hash, if any
 	uint8_t hash[SHA1_DIGEST_LENGTH];
 
+	//! \brief Index of the block implementation in use
+	static int implementation;
+
         //! \brief *Process the next 512 bits of the message
         void ProcessMessageBlock();
 
         //!\ \brief  Pads the current message block to 512 bits
         void PadMessage();
 
-        /*
-         *  Performs a circular left shift operation
-         */
-        inline unsigned CircularShift(int bits, unsigned word);
-
-        unsigned H[5];                      // Message digest buffers
+        uint32_t H[5];                      // Message digest buffers
 
         unsigned Length_Low;                // Message length in bits
         unsigned Length_High;               // Message length in bits
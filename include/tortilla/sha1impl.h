@@ -0,0 +1,41 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __TORTILLA_SHA1IMPL_H__
+#define __TORTILLA_SHA1IMPL_H__
+
+/*
+ * The x86 implementations rely on per-function target attributes, so that
+ * the library itself needn't be built for a specific CPU.
+ */
+#if (defined(__i386__) || defined(__x86_64__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SHA1_HAVE_X86
+#endif
+
+namespace Tortilla {
+
+/*! \brief Processes a number of consecutive 64-byte SHA1 blocks
+ *  \param H Intermediate hash value, updated in place
+ *  \param data Blocks to process
+ *  \param numBlocks Number of blocks to process
+ */
+typedef void (*SHA1BlockFunction)(uint32_t* H, const uint8_t* data, size_t numBlocks);
+
+//! \brief Portable implementation
+void sha1_blocks_generic(uint32_t* H, const uint8_t* data, size_t numBlocks);
+
+#ifdef SHA1_HAVE_X86
+//! \brief Scalar rounds, message schedule computed using SSSE3
+void sha1_blocks_ssse3(uint32_t* H, const uint8_t* data, size_t numBlocks);
+
+//! \brief As SSSE3, calculating the schedule of two blocks at a time; needs BMI
+void sha1_blocks_avx2(uint32_t* H, const uint8_t* data, size_t numBlocks);
+
+//! \brief Uses the SHA extensions (SHA-NI); needs SSE4.1 as well
+void sha1_blocks_shani(uint32_t* H, const uint8_t* data, size_t numBlocks);
+#endif
+
+}
+
+#endif /* __TORTILLA_SHA1IMPL_H__ */
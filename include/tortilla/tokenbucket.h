@@ -0,0 +1,92 @@
+#include <boost/thread/mutex.hpp>
+#include <sys/types.h>
+#include <stdint.h>
+
+#ifndef __TORTILLA_TOKENBUCKET_H__
+#define __TORTILLA_TOKENBUCKET_H__
+
+namespace Tortilla {
+
+/*! \brief Amount of time worth of tokens a bucket may hold, in milliseconds
+ *
+ *  This bounds the burst a bucket allows after being idle.
+ */
+#define TOKENBUCKET_BURST_TIME 100
+
+/*! \brief Minimum number of tokens that are handed out at once
+ *
+ *  This is about a single TCP segment; handing out less only results in
+ *  lots of tiny writes.
+ */
+#define TOKENBUCKET_MIN_QUANTUM 1460
+
+/*! \brief Limits a rate of bytes per second
+ *
+ *  Tokens are added continuously based on the time elapsed since the last
+ *  refill, so they become available as soon as they are earned rather than
+ *  once per second.
+ */
+class TokenBucket {
+public:
+	/*! \brief Constructs a new token bucket
+	 *  \param rate Rate, in bytes/second, or zero for unlimited
+	 */
+	TokenBucket(uint32_t rate = 0);
+
+	/*! \brief Set the rate, in bytes/second
+	 *
+	 *  A rate of zero indicates no limit is enforced.
+	 */
+	void setRate(uint32_t rate);
+
+	//! \brief Retrieve the rate, in bytes/second
+	uint32_t getRate() const;
+
+	/*! \brief Retrieve the number of bytes that may be transferred
+	 *  \param delay Set to the number of microseconds until bytes are available
+	 *  \return Number of bytes, or -1 if unlimited
+	 *
+	 *  The delay is only updated if zero is returned.
+	 */
+	ssize_t getAvailable(uint64_t& delay);
+
+	//! \brief Take a number of bytes from the bucket
+	void consume(size_t amount);
+
+	/*! \brief Combine two amounts as returned by getAvailable()
+	 *  \return The most restrictive amount
+	 */
+	static ssize_t limit(ssize_t a, ssize_t b);
+
+	//! \brief Retrieve a monotonic timestamp, in microseconds
+	static uint64_t getTime();
+
+private:
+	//! \brief Add tokens earned since the last refill
+	void refill();
+
+	//! \brief Mutex protecting our data
+	mutable boost::mutex mtx_data;
+
+	/*! \brief Rate, in bytes/second
+	 *
+	 *  Zero indicates unlimited.
+	 */
+	uint32_t rate;
+
+	//! \brief Maximum number of tokens the bucket holds
+	uint32_t burst;
+
+	/*! \brief Number of tokens in the bucket
+	 *
+	 *  This may be negative if more was consumed than available.
+	 */
+	int64_t tokens;
+
+	//! \brief Time of the last refill
+	uint64_t lastRefill;
+};
+
+}
+
+#endif /* __TORTILLA_TOKENBUCKET_H__ */
@@ -1,12 +1,17 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/shared_mutex.hpp>
+#include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
+#include "bitfield.h"
 #include "file.h"
 #include "info.h"
 #include "peer.h"
 #include "metadata.h"
+#include "piecepicker.h"
+#include "tokenbucket.h"
 
 #ifndef __TORTILLA_TORRENT_H__
 #define __TORTILLA_TORRENT_H__
@@ -30,20 +35,39 @@ namespace Tortilla {
 //! \brief Desired number of peers per torrent
 #define TORRENT_DESIRED_PEERS 30
 
+/*! \brief Maximum number of outgoing connections being set up per torrent
+ *
+ *  This includes attempts still waiting for the connection manager.
+ */
+#define TORRENT_MAX_HALFOPEN 8
+
 //! \brief Delta in seconds between running (un)choking algorithm
 #define TORRENT_DELTA_CHOKING_ALGO 10
 
 //! \brief Percentage completed when we enter endgame mode
 #define TORRENT_ENDGAME_PERCENTAGE	95
 
+/*! \brief Number of pieces to pick at once when scheduling requests
+ *
+ *  If none of them can be requested, twice as many are picked next time.
+ */
+#define TORRENT_PICK_CANDIDATES		8
+
 //! \brief Maximum number of peers unchoked by us at any time per torrent
 #define TORRENT_MAX_UNCHOKED_PEERS	4
+
+/*! \brief Maximum number of bytes of pieces kept in memory per torrent
+ *
+ *  Pieces that don't fit are written to the output files chunk by chunk.
+ */
+#define TORRENT_MAX_BUFFERED		(64 * 1024 * 1024)
     
 class Connection;
 class Peer;
 class HTTPRequest;
 class Overseer;
 class PendingPeer;
+class PieceBuffer;
 class SenderRequest;
 class TrackerTalker;
 class Tracer;
@@ -61,6 +85,7 @@ friend class Overseer;
 friend class Hasher;
 friend class SenderRequest;
 friend class TrackerTalker;
+friend class ConnectionManager;
 public:
 	/*! \brief Constructs a new torrent object
 	 *  \param o Overseer to use
@@ -91,6 +116,15 @@ public:
 	//! \brief Do we have a piece?
 	bool hasPiece(unsigned int piece) const;
 
+	//! \brief Retrieve a copy of the pieces we have
+	Bitfield getPieceMap() const;
+
+	/*! \brief Can a piece be uploaded?
+	 *
+	 *  This is the case if we have the piece, and it's verified and on disk.
+	 */
+	bool canUploadPiece(unsigned int piece) const;
+
 	//! \brief How much data is in this torrent?
 	const uint64_t getTotalSize() const { return total_size; }
 
@@ -102,6 +136,9 @@ public:
 	/*! \brief Returns the number of pieces for a given chunk */
 	unsigned int calculateChunksInPiece(unsigned int piece) const;
 
+	/*! \brief Returns the length of a given piece, in bytes */
+	uint32_t calculatePieceLength(unsigned int piece) const;
+
 	/*! \brief Retrieve the torrent's peer ID */
 	const uint8_t* getPeerID() const;
 
@@ -131,6 +168,24 @@ public:
 	 */
 	void getRateCounters(uint32_t* rx, uint32_t* tx);
 
+	/*! \brief Set the upload rate of this torrent, in bytes/second
+	 *
+	 *  An upload rate of zero indicates only the overseer's limit applies.
+	 */
+	void setUploadRate(uint32_t rate) { upload_bucket.setRate(rate); }
+
+	//! \brief Retrieve the upload rate of this torrent, in bytes/second
+	uint32_t getUploadRate() const { return upload_bucket.getRate(); }
+
+	/*! \brief Set the download rate of this torrent, in bytes/second
+	 *
+	 *  A download rate of zero indicates only the overseer's limit applies.
+	 */
+	void setDownloadRate(uint32_t rate) { download_bucket.setRate(rate); }
+
+	//! \brief Retrieve the download rate of this torrent, in bytes/second
+	uint32_t getDownloadRate() const { return download_bucket.getRate(); }
+
 	//! \brief Retrieve the torrent name
 	const std::string& getName() const { return name; }
 
@@ -223,7 +278,23 @@ protected:
 	/*! \brief Called by a peer if a chunk is completed */
 	void callbackCompleteChunk(Peer* p, unsigned int piece, uint32_t offset, const uint8_t* data, uint32_t len);
 
-	/*! \brief Called by a peer if a piece is completed */
+	/*! \brief Called by a peer if outstanding requests will not be serviced
+	 *
+	 *  The chunks involved can then be requested from other peers.
+	 */
+	void callbackChunkRequestsDropped(Peer* p, const std::set<OutstandingChunkRequest>& requests);
+
+	/*! \brief Called by a peer if a single request is no longer outstanding
+	 *
+	 *  This is the case if it was serviced or cancelled.
+	 */
+	void callbackChunkRequestDone(Peer* p, unsigned int piece, uint32_t offset);
+
+	/*! \brief Called by a peer if a piece is completed
+	 *
+	 *  The piece must already have been marked as present and as being
+	 *  hashed.
+	 */
 	void callbackCompletePiece(Peer* p, unsigned int piece);
 
 	/*! \brief Called by the hasher if piece hashing results are in */
@@ -241,6 +312,18 @@ protected:
 	//! \brief Called once the tracker reply is in
 	void callbackTrackerReply(std::string result, bool error);
 
+	/*! \brief Called by the connection manager once a peer is connecting
+	 *
+	 *  The peer will be added to the torrent.
+	 */
+	void callbackPeerConnecting(Peer* p);
+
+	//! \brief Called by the connection manager if a peer couldn't be connected to
+	void callbackPeerConnectFailed();
+
+	//! \brief Called by a peer once its outgoing connection is established or gone
+	void callbackPeerConnected(Peer* p);
+
 	//! \brief Called periodically to update bandwidth use
 	void updateBandwidth();
 
@@ -266,19 +349,51 @@ protected:
 	 */
 	bool readChunk(unsigned int piece, unsigned int offset, uint8_t* buf, size_t length);
 
+	/*! \brief Sends a chunk from the output files to a socket
+	 *  \param sockfd Socket to send to
+	 *  \param piece Piece number to send
+	 *  \param offset Byte offset within piece
+	 *  \param length Length of the chunk
+	 *  \returns Number of bytes sent, or -1 on error
+	 *
+	 *  The amount sent may be short, or even zero, if the socket is full.
+	 */
+	ssize_t sendChunk(int sockfd, unsigned int piece, unsigned int offset, size_t length);
+
+	/*! \brief Starts reading a chunk from the output files in the background
+	 *
+	 *  This is only a hint; it is used to get chunks we are about to upload
+	 *  in memory before they are needed.
+	 */
+	void prefetchChunk(unsigned int piece, unsigned int offset, size_t length);
+
 	//! \brief Increment the uploaded byte counter
 	void incrementUploadedBytes(uint64_t amount);
 
 	/*! \brief Handle status update to peers
 	 *
-	 *  This function will update all connected peers that we have gained
-	 *  or lost interest in them. It will also attempt to ditch anyone who
-	 *  is also a seeder to give leechers a better chance of getting a
-	 *  seeder (plus, there's nothing we gain by connecting to a seeder
-	 *  when we have all data anyway)
+	 *  This function will attempt to ditch anyone who is also a seeder to
+	 *  give leechers a better chance of getting a seeder (plus, there's
+	 *  nothing we gain by connecting to a seeder when we have all data
+	 *  anyway)
 	 */
 	void processPeerStatus();
 
+	/*! \brief Update the number of pieces every peer has which we lack
+	 *  \param piece Piece of which our state changed
+	 *  \param have Do we have the piece now?
+	 *
+	 *  Interest is claimed or revoked only as this number crosses zero.
+	 *  Must be called with the data mutex held.
+	 */
+	void updateWantedPieces(unsigned int piece, bool have);
+
+	/*! \brief Forget a single request of a chunk
+	 *
+	 *  Must be called with the data mutex held.
+	 */
+	void releaseChunkRequest(unsigned int chunkIndex);
+
 	/*! \brief Ask for new pieces from a peer
 	 *  \param p Peer to use
 	 *
@@ -286,8 +401,8 @@ protected:
 	 */
 	void schedulePeerRequests(Peer* p);
 
-	//! \brief Request the sender to awaken
-	void signalSender() const;
+	//! \brief Request the sender to awaken for a peer's file descriptor
+	void signalSender(int fd) const;
 
 	/*! \brief Log a message
 	 *  \param p If set, use this peer
@@ -321,15 +436,34 @@ private:
 	 */
 	void contactTracker(std::string event);
 
+	//! \brief Operations handleChunk() can perform
+	enum ChunkOperation {
+		//! \brief Read the chunk into the buffer
+		CHUNK_READ,
+		//! \brief Write the buffer to the chunk
+		CHUNK_WRITE,
+		//! \brief Ask the OS to start reading the chunk; the buffer is unused
+		CHUNK_PREFETCH
+	};
+
 	/*! \brief Handle a chunk from or to our output files
 	 *  \param piece Piece number to write
 	 *  \param offset Byte offset within piece
 	 *  \param buf Buffer containing data to write
 	 *  \param length Length of the chunk
-	 *  \param writing Write the chunk if true, otherwise read
+	 *  \param op Operation to perform
 	 *  \returns true on success
 	 */
-	bool handleChunk(unsigned int piece, unsigned int offset, uint8_t* buf, size_t length, bool writing);
+	bool handleChunk(unsigned int piece, unsigned int offset, uint8_t* buf, size_t length, ChunkOperation op);
+
+	/*! \brief Locate the file containing a position
+	 *  \param absolutePos Absolute position, updated to be relative to the file
+	 *  \param idx Receives the index of the file
+	 *  \returns File containing the position, or NULL if out of range
+	 *
+	 *  Must be called with rwl_files held.
+	 */
+	File* locateFile(off_t& absolutePos, unsigned int& idx);
 
 	/*! \brief Writes a chunk to our output files
 	 *  \param piece Piece number to write
@@ -340,6 +474,20 @@ private:
 	 */
 	bool writeChunk(unsigned int piece, unsigned int offset, const uint8_t* buf, size_t length);
 
+	/*! \brief Retrieve the buffer of a piece being downloaded
+	 *  \param piece Piece to retrieve
+	 *  \returns Piece buffer, or NULL if the piece isn't kept in memory
+	 */
+	PieceBuffer* getPieceBuffer(unsigned int piece) const;
+
+	/*! \brief Retrieve the buffer of a piece, creating it if needed
+	 *  \param piece Piece to retrieve
+	 *  \returns Piece buffer, or NULL if the piece is to be written directly
+	 *
+	 *  Must be called with mtx_data held.
+	 */
+	PieceBuffer* obtainPieceBuffer(unsigned int piece);
+
 	/*! \brief Handles the reply of the tracker */
 	void handleTrackerReply(std::string reply);
 
@@ -381,40 +529,63 @@ private:
 	/*! \brief Which pieces do we have?
 	 *
 	 *  This refers to the BitTorrent definition of pieces, i.e.
-	 *  this vector contains numPieces booleans.
+	 *  this bitfield contains numPieces bits.
 	 */
-	std::vector<bool> /* [M=data] */ havePiece;
+	Bitfield /* [M=data] */ havePiece;
 
 	/*! \brief Which chunks do we have?
 	 *
 	 *  We consider a chunk data that can atomically be moved between two
 	 *  peers (atomically as in: give me this data, and we either get all
 	 *  of it or we don't get it) Therefore, every BitTorrent piece
-	 *  consists of a fixed number of chunks. Using this vector, we keep
+	 *  consists of a fixed number of chunks. Using this bitfield, we keep
 	 *  track of the chunks we need in order to complete a piece.
 	 *
-	 *  Note that  this vector can be used to compute havePiece, which we
+	 *  Note that  this bitfield can be used to compute havePiece, which we
 	 *  won't do for efficiency reasons.
 	 */
-	std::vector<bool> /* [M=data] */ haveChunk;
+	Bitfield /* [M=data] */ haveChunk;
+
+	/*! \brief Buffers of pieces being downloaded
+	 *
+	 *  Chunks are stored here rather than in the output files; pieces are
+	 *  only written once they are complete and their hash checks out. Pieces
+	 *  without a buffer are written chunk by chunk.
+	 */
+	std::map<unsigned int, PieceBuffer*> /* [M=data] */ pieceBuffers;
+
+	//! \brief Number of bytes held by pieceBuffers
+	uint64_t /* [M=data] */ bufferedBytes;
 
 	/*! \brief Which chunks are requested?
 	 *
-	 *  We keep track per chunk which peers we have requested the chunk of;
-	 *  this is needed in endgame mode, where we don't want to flood a peer
-	 *  with requests.
+	 *  A chunk is marked as long as it is requested from at least a single
+	 *  peer. The peers themselves know which chunks they requested.
 	 */
-	std::vector<PeerList> /* [M=data] */ haveRequestedChunk;
+	Bitfield /* [M=data] */ requestedChunk;
+
+	/*! \brief Number of additional peers chunks are requested from
+	 *
+	 *  Only in endgame mode will we request a chunk from more than a single
+	 *  peer, so this only lists those few chunks.
+	 */
+	std::map<unsigned int, unsigned int> /* [M=data] */ duplicateChunkRequests;
 
 	//! \brief Which pieces are being hashed?
-	std::vector<bool> /* [M=data] */ hashingPiece;
+	Bitfield /* [M=data] */ hashingPiece;
+
+	//! \brief Number of chunks we have of each piece
+	std::vector<unsigned int> /* [M=data] */ numChunksReceived;
+
+	//! \brief Number of pieces we have and aren't hashing
+	unsigned int /* [M=data] */ numPiecesComplete;
 
-	/*! \brief Stores the cardinality of each piece
+	/*! \brief Decides which pieces to request
 	 *
-	 *  The cardinality of a piece of defined as the numer of peers that
-	 *  have the piece 
+	 *  This keeps track of the cardinality of each piece, which is defined
+	 *  as the number of peers that have the piece.
 	 */
-	std::vector<unsigned int> /* [M=data] */ pieceCardinality;
+	PiecePicker* /* [M=data] */ picker;
 
 	/*! \brief List of peers
 	 *
@@ -456,6 +627,12 @@ private:
 	//! \brief Transmit rate, in bytes
 	uint32_t tx_rate;
 
+	//! \brief Limits the upload rate of this torrent
+	TokenBucket upload_bucket;
+
+	//! \brief Limits the download rate of this torrent
+	TokenBucket download_bucket;
+
 	//! \brief Is the torrent complete?
 	bool complete;
 
@@ -489,6 +666,12 @@ private:
 	//! \brief List of pending peers we may try to use
 	std::list<PendingPeer*> /* [M=data] */ pendingPeers;
 
+	//! \brief Number of peers handed to the connection manager, not yet connecting
+	unsigned int /* [M=data] */ numConnectsQueued;
+
+	//! \brief Number of peers we are connecting to
+	unsigned int /* [M=data] */ numConnectsHalfOpen;
+
 	/*! \brief Number of pieces currently hashing
 	 *
 	 *  This is used at startup; the torrent won't request
@@ -0,0 +1,197 @@
+#include <string.h>
+#include "bitfield.h"
+#include "cpufeatures.h"
+
+/*
+ * As with SHA1, the AVX2 code relies on per-function target attributes so
+ * that the library itself needn't be built for a specific CPU.
+ */
+#if (defined(__i386__) || defined(__x86_64__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define BITFIELD_HAVE_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace Tortilla;
+
+/*! \brief Counts the bits set in a
+ *  \param n Number of words in a
+ */
+typedef size_t (*BitfieldCountFunction)(const uint64_t* a, size_t n);
+
+/*! \brief Finds the first word that has any bit set
+ *  \return Index of the word, or n if there is none
+ */
+typedef size_t (*BitfieldFindFunction)(const uint64_t* a, size_t n);
+
+static size_t
+bitfield_count_generic(const uint64_t* a, size_t n)
+{
+	size_t num = 0;
+	for (size_t i = 0; i < n; i++)
+		num += __builtin_popcountll(a[i]);
+	return num;
+}
+
+static size_t
+bitfield_find_generic(const uint64_t* a, size_t n)
+{
+	size_t i = 0;
+	while (i < n && a[i] == 0)
+		i++;
+	return i;
+}
+
+#ifdef BITFIELD_HAVE_X86
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+/*
+ * AVX2 lacks a vector popcount; instead, look up the count of every nibble
+ * and add the bytes per 64-bit lane.
+ */
+static size_t AVX2_TARGET
+bitfield_count_avx2(const uint64_t* a, size_t n)
+{
+	const __m256i lookup = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i acc = _mm256_setzero_si256();
+
+	size_t i = 0;
+	for (/* nothing */; i + 4 <= n; i += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i lo = _mm256_and_si256(v, nibble);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+		__m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+	}
+
+	uint64_t sum[4];
+	_mm256_storeu_si256((__m256i*)sum, acc);
+	return sum[0] + sum[1] + sum[2] + sum[3] + bitfield_count_generic(a + i, n - i);
+}
+
+static size_t AVX2_TARGET
+bitfield_find_avx2(const uint64_t* a, size_t n)
+{
+	size_t i = 0;
+	for (/* nothing */; i + 4 <= n; i += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(a + i));
+		if (!_mm256_testz_si256(v, v))
+			break;
+	}
+	return i + bitfield_find_generic(a + i, n - i);
+}
+
+#endif /* BITFIELD_HAVE_X86 */
+
+/*
+ * Select the widest implementations supported by the CPU.
+ */
+static BitfieldCountFunction
+bitfield_count_select()
+{
+#ifdef BITFIELD_HAVE_X86
+	if (CPUFeatures::hasAVX2())
+		return bitfield_count_avx2;
+#endif
+	return bitfield_count_generic;
+}
+
+static BitfieldFindFunction
+bitfield_find_select()
+{
+#ifdef BITFIELD_HAVE_X86
+	if (CPUFeatures::hasAVX2())
+		return bitfield_find_avx2;
+#endif
+	return bitfield_find_generic;
+}
+
+static BitfieldCountFunction bitfield_count = bitfield_count_select();
+static BitfieldFindFunction bitfield_find = bitfield_find_select();
+
+//! \brief Reverses the bits of a byte
+static inline uint8_t
+reverse_byte(uint8_t b)
+{
+	b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+	b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+	b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+	return b;
+}
+
+Bitfield::Bitfield(size_t num)
+	: numBits(0)
+{
+	resize(num);
+}
+
+void
+Bitfield::resize(size_t num)
+{
+	/* Clear the bits beyond the current size, so they will be zero when added */
+	if (numBits % 64)
+		words[numBits / 64] &= ((uint64_t)1 << (numBits % 64)) - 1;
+	words.resize((num + 63) / 64, 0);
+	numBits = num;
+	if (numBits % 64)
+		words[numBits / 64] &= ((uint64_t)1 << (numBits % 64)) - 1;
+}
+
+size_t
+Bitfield::count() const
+{
+	return words.empty() ? 0 : bitfield_count(&words[0], words.size());
+}
+
+size_t
+Bitfield::findNext(size_t from) const
+{
+	if (from >= numBits)
+		return numBits;
+
+	/* Look at the remainder of the first word by hand */
+	size_t w = from / 64;
+	uint64_t bits = words[w] & (~(uint64_t)0 << (from % 64));
+	if (bits == 0) {
+		w++;
+		w += bitfield_find(&words[0] + w, words.size() - w);
+		if (w == words.size())
+			return numBits;
+		bits = words[w];
+	}
+	return w * 64 + __builtin_ctzll(bits);
+}
+
+void
+Bitfield::load(const uint8_t* data)
+{
+	/*
+	 * The first bit on the wire is the most significant one, whereas we use
+	 * the least significant bit first; reversing every byte takes care of
+	 * this.
+	 */
+	if (words.empty())
+		return;
+
+	size_t len = (numBits + 7) / 8;
+	memset(&words[0], 0, words.size() * sizeof(uint64_t));
+	for (size_t i = 0; i < len; i++)
+		words[i / 8] |= (uint64_t)reverse_byte(data[i]) << ((i % 8) * 8);
+	if (numBits % 64)
+		words[numBits / 64] &= ((uint64_t)1 << (numBits % 64)) - 1;
+}
+
+void
+Bitfield::store(uint8_t* data) const
+{
+	size_t len = (numBits + 7) / 8;
+	for (size_t i = 0; i < len; i++)
+		data[i] = reverse_byte((uint8_t)(words[i / 8] >> ((i % 8) * 8)));
+}
+
+/* vim:set ts=2 sw=2: */
@@ -7,6 +7,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include <iostream>
 #include "exceptions.h"
 #include "connection.h"
@@ -25,6 +27,12 @@ Connection::Connection(string host, uint16_t port)
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE;
 
+	/* IP addresses need no resolving; never bother the resolver with them */
+	struct in6_addr addr;
+	if (inet_pton(AF_INET, host.c_str(), &addr) == 1 ||
+	    inet_pton(AF_INET6, host.c_str(), &addr) == 1)
+		hints.ai_flags |= AI_NUMERICHOST;
+
 	snprintf(portstr, sizeof(portstr), "%u", port);
 	int i = getaddrinfo(host.c_str(), portstr, &hints, &result);
 	if (i != 0)
@@ -86,6 +94,11 @@ Connection::Connection(uint16_t port)
 
 	if (listen(fd, 5) < 0)
 		throw ConnectionException("listen(): " + string(strerror(errno)));
+
+	/* Never block in accept(2); this allows draining all pending connections */
+	int fl = fcntl(fd, F_GETFL, NULL);
+	fl |= O_NONBLOCK;
+	fcntl(fd, F_SETFL, fl);
 }
 
 Connection::Connection(int s, struct sockaddr* soa, socklen_t slen)
@@ -111,6 +124,22 @@ Connection::write(const void* buf, size_t len)
 	return ::write(fd, buf, len);
 }
 
+ssize_t
+Connection::writev(const struct iovec* iov, int iovcnt, bool more)
+{
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec*)iov;
+	msg.msg_iovlen = iovcnt;
+
+	int flags = 0;
+#ifdef MSG_MORE
+	if (more)
+		flags |= MSG_MORE;
+#endif
+	return sendmsg(fd, &msg, flags);
+}
+
 Connection*
 Connection::acceptConnection()
 {
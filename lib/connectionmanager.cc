@@ -0,0 +1,122 @@
+#include <boost/thread/locks.hpp>
+#include <assert.h>
+#include "connectionmanager.h"
+#include "macros.h"
+#include "overseer.h"
+#include "pendingpeer.h"
+#include "tracer.h"
+
+using namespace std;
+using namespace boost;
+using namespace Tortilla;
+
+#define TRACER (overseer->getTracer())
+
+namespace Tortilla {
+	void* connectionmanager_thread(void* ptr)
+	{
+		((ConnectionManager*)ptr)->run();
+		return NULL;
+	}
+}
+
+ConnectionManager::ConnectionManager(Overseer* o)
+	: numHalfOpen(0), current(NULL), terminating(false), overseer(o),
+	  thread(connectionmanager_thread, this)
+{
+}
+
+ConnectionManager::~ConnectionManager()
+{
+	{
+		unique_lock<mutex> lock(mtx_data);
+		terminating = true;
+	}
+	cv.notify_one();
+	thread.join();
+
+	while (!queue.empty()) {
+		delete queue.front();
+		queue.pop_front();
+	}
+}
+
+void
+ConnectionManager::connect(PendingPeer* pp)
+{
+	{
+		unique_lock<mutex> lock(mtx_data);
+		queue.push_back(pp);
+	}
+	cv.notify_one();
+}
+
+void
+ConnectionManager::connectionDone()
+{
+	{
+		unique_lock<mutex> lock(mtx_data);
+		assert(numHalfOpen > 0);
+		numHalfOpen--;
+	}
+	cv.notify_one();
+}
+
+void
+ConnectionManager::run()
+{
+	unique_lock<mutex> lock(mtx_data);
+	while (true) {
+		/* Wait until there is something to do, and room to do it in */
+		while (!terminating && (queue.empty() || numHalfOpen >= CONNECTIONMANAGER_MAX_HALFOPEN))
+			cv.wait(lock);
+		if (terminating)
+			break;
+
+		PendingPeer* pp = queue.front();
+		queue.pop_front();
+		Torrent* t = pp->getTorrent();
+		current = t; numHalfOpen++;
+
+		/*
+		 * Let go of the mutex while connecting; resolving the peer's address may
+		 * take a while if it isn't an IP address.
+		 */
+		lock.unlock();
+		Peer* p = pp->connect();
+		delete pp;
+		if (p != NULL)
+			t->callbackPeerConnecting(p);
+		else
+			t->callbackPeerConnectFailed();
+		lock.lock();
+
+		/* A failed attempt never became half-open */
+		if (p == NULL)
+			numHalfOpen--;
+		current = NULL;
+		cv_done.notify_all();
+	}
+}
+
+void
+ConnectionManager::cancelTorrent(Torrent* t)
+{
+	unique_lock<mutex> lock(mtx_data);
+	list<PendingPeer*>::iterator it = queue.begin();
+	while (it != queue.end()) {
+		PendingPeer* pp = *it;
+		if (pp->getTorrent() != t) {
+			it++;
+			continue;
+		}
+		it = queue.erase(it);
+		delete pp;
+	}
+
+	/* Wait for any attempt in progress; it may still refer to the torrent */
+	while (current == t)
+		cv_done.wait(lock);
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,55 @@
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#include <stddef.h>
+#include <stdint.h>
+#include "cpufeatures.h"
+
+using namespace Tortilla;
+
+#if defined(__i386__) || defined(__x86_64__)
+//! \brief Retrieve the extended control register holding the OS-enabled state
+static uint64_t
+read_xcr0()
+{
+	uint32_t eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	return ((uint64_t)edx << 32) | eax;
+}
+#endif
+
+CPUFeatures::CPUFeatures()
+	: sse2(false), ssse3(false), sse41(false), avx2(false), bmi(false), sha(false)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return;
+	sse2 = (edx & bit_SSE2) != 0;
+	ssse3 = (ecx & bit_SSSE3) != 0;
+	sse41 = (ecx & bit_SSE4_1) != 0;
+
+	/*
+	 * AVX2 also needs the OS to save the YMM registers on context switch,
+	 * which is only the case if it has enabled them in XCR0.
+	 */
+	bool ymm = (ecx & bit_OSXSAVE) && (ecx & bit_AVX) && (read_xcr0() & 6) == 6;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	avx2 = ymm && (ebx & (1 << 5)) != 0;
+	bmi = (ebx & (1 << 3)) != 0 && (ebx & (1 << 8)) != 0;
+	sha = (ebx & (1 << 29)) != 0;
+#endif
+}
+
+const CPUFeatures&
+CPUFeatures::get()
+{
+	/* Probed on first use; the compiler serializes the initialization */
+	static CPUFeatures features;
+	return features;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -3,11 +3,16 @@
 #include <sys/stat.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <algorithm>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "exceptions.h"
 #include "file.h"
 #include "macros.h"
@@ -94,6 +99,53 @@ File::read(off_t offset, void* buf, size_t len)
 		throw FileException("short read");
 }
 
+ssize_t
+File::send(int sockfd, off_t offset, size_t len)
+{
+	assert(offset + (off_t)len <= length);
+	assert(isOpened());
+
+	lastInteraction = time(NULL);
+#ifdef __linux__
+	/* The kernel moves the data from the page cache to the socket directly */
+	ssize_t n = sendfile(sockfd, fd, &offset, len);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0; /* socket is full */
+	if (n == 0 && len > 0)
+		return -1; /* end of file */
+	return n;
+#else
+	/* No portable zero-copy interface; bounce the data through a buffer */
+	ssize_t total = 0;
+	while (len > 0) {
+		uint8_t buf[FILE_SEND_BUFFER_SIZE];
+		ssize_t n = pread(fd, buf, std::min(len, sizeof(buf)), offset);
+		if (n <= 0)
+			return (total > 0) ? total : -1; /* end of file or read error */
+		ssize_t written = ::write(sockfd, buf, n);
+		if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break; /* socket is full */
+		if (written < 0)
+			return (total > 0) ? total : -1;
+		total += written; offset += written; len -= written;
+		if (written < n)
+			break; /* socket is full */
+	}
+	return total;
+#endif
+}
+
+void
+File::prefetch(off_t offset, size_t len)
+{
+	assert(offset + (off_t)len <= length);
+	assert(isOpened());
+
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
 File::~File()
 {
 	/* Lock the file before closing it; this ensures we wait until consumers are done */
@@ -44,6 +44,25 @@ FileManager::readFile(File* f, off_t offset, void* buf, size_t len)
 	f->unlock();
 }
 
+ssize_t
+FileManager::sendFile(File* f, int sockfd, off_t offset, size_t len)
+{
+	f->lockRead();
+	prepare(f);
+	ssize_t result = f->send(sockfd, offset, len);
+	f->unlock();
+	return result;
+}
+
+void
+FileManager::prefetchFile(File* f, off_t offset, size_t len)
+{
+	f->lockRead();
+	prepare(f);
+	f->prefetch(offset, len);
+	f->unlock();
+}
+
 void
 FileManager::prepare(File* f)
 {
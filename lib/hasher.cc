@@ -2,10 +2,11 @@
 #include <algorithm>
 #include <assert.h>
 #include <string.h>
-#include <algorithm>
 #include "hasher.h"
 #include "macros.h"
+#include "multisha1.h"
 #include "overseer.h"
+#include "piecebuffer.h"
 #include "tracer.h"
 #include "sha1.h"
 
@@ -23,28 +24,95 @@ namespace Tortilla {
 	}
 }
 
-Hasher::Hasher(Overseer* o)
-	: thread(hasher_thread, this)
+void
+HasherQueue::push(Torrent* t, unsigned int piece)
+{
+	list<unsigned int>& l = pieces[t];
+	if (l.empty())
+		order.push_back(t);
+	l.push_back(piece);
+}
+
+bool
+HasherQueue::pop(HasherItem& hi)
+{
+	if (order.empty())
+		return false;
+
+	/*
+	 * Take a piece from the torrent at the front and move the torrent to the
+	 * back if it has more; this gives every torrent its turn.
+	 */
+	Torrent* t = order.front();
+	order.pop_front();
+	map<Torrent*, list<unsigned int> >::iterator it = pieces.find(t);
+	assert(it != pieces.end() && !it->second.empty());
+	hi = HasherItem(t, it->second.front());
+	it->second.pop_front();
+	if (it->second.empty())
+		pieces.erase(it);
+	else
+		order.push_back(t);
+	return true;
+}
+
+bool
+HasherQueue::popTorrent(Torrent* t, HasherItem& hi)
+{
+	map<Torrent*, list<unsigned int> >::iterator it = pieces.find(t);
+	if (it == pieces.end())
+		return false;
+	hi = HasherItem(t, it->second.front());
+	it->second.pop_front();
+	if (it->second.empty()) {
+		pieces.erase(it);
+		order.remove(t);
+	}
+	return true;
+}
+
+void
+HasherQueue::removeTorrent(Torrent* t)
+{
+	order.remove(t);
+	pieces.erase(t);
+}
+
+Hasher::Hasher(Overseer* o, unsigned int numThreads)
+	: terminating(false), batchSize(MultiHashSHA1::getPreferredLanes()), overseer(o)
 {
-	terminating = false; overseer = o;
+	if (numThreads == 0)
+		numThreads = 1;
+	for (unsigned int i = 0; i < numThreads; i++)
+		threads.push_back(new boost::thread(hasher_thread, this));
 }
 
 Hasher::~Hasher()
 {
-	/* Request termination, kick the thread and wait till it's gone */
-	terminating = true;
-	cv.notify_one();
-	thread.join();
+	/* Request termination, kick the threads and wait till they're gone */
+	{
+		unique_lock<mutex> lock(mtx_data);
+		terminating = true;
+	}
+	cv.notify_all();
+	for (vector<boost::thread*>::iterator it = threads.begin();
+	     it != threads.end(); it++) {
+		(*it)->join();
+		delete *it;
+	}
 }
 
 void
-Hasher::addPiece(Torrent* t, unsigned int num)
+Hasher::addPiece(Torrent* t, unsigned int num, bool recheck)
 {
 	assert (t->getPieceLength() % HASHER_CHUNK_SIZE == 0);
 
 	{
 		unique_lock<mutex> lock(mtx_data);
-		hashQueue.push_back(HasherItem(t, num));
+		if (recheck)
+			recheckQueue.push(t, num);
+		else
+			freshQueue.push(t, num);
 	}
 
 	/* Get back to work, you slacker! */
@@ -53,74 +121,135 @@ Hasher::addPiece(Torrent* t, unsigned int num)
 
 void
 Hasher::run() {
+	unique_lock<mutex> lock(mtx_data);
 	while(true) {
 		/* If needed, wait until some event arrives */
-		unique_lock<mutex> lock(mtx_data);
-		if (!terminating && hashQueue.empty())
+		while (!terminating && freshQueue.empty() && recheckQueue.empty())
 			cv.wait(lock);
 		if (terminating)
 			break;
 
-		assert(!hashQueue.empty());
-		while (!hashQueue.empty() && !terminating) {
-			HasherItem hi = hashQueue.front();
-			hashQueue.pop_front();
-			/* Unlock the mutex; we don't want to block waiters on hashing */
-			lock.unlock();
-			TRACE(HASHER, "hashing started: torrent=%p,piece=%u", hi.getTorrent(), hi.getPiece());
-
-			/*
-			 * While hashing, let go of the mutex; we'd be holding
-			 * it unnecessarily long, as we can happily hash
-			 * without it...
-			 */
-			Torrent* torrent = hi.getTorrent();
-			unsigned int piecenum = hi.getPiece();
-			unsigned int todo;
-			if (piecenum == torrent->getNumPieces() - 1) {
-				todo = torrent->getTotalSize() % torrent->getPieceLength();
-			} else {
-				todo = torrent->getPieceLength();
-			}
+		/* Fresh pieces go first; peers are waiting for them to be announced */
+		HasherItem hi(NULL, 0);
+		vector<HasherItem> batch;
+		if (freshQueue.pop(hi)) {
+			batch.push_back(hi);
+		} else {
+			recheckQueue.pop(hi);
+			batch.push_back(hi);
+			while (batch.size() < batchSize && recheckQueue.popTorrent(hi.getTorrent(), hi))
+				batch.push_back(hi);
+		}
+		busy.insert(hi.getTorrent());
+
+		/*
+		 * While hashing, let go of the mutex; we'd be holding it unnecessarily
+		 * long, as we can happily hash without it...
+		 */
+		lock.unlock();
+		if (batch.size() == 1)
+			hashPiece(batch.front());
+		else
+			hashBatch(batch);
+		lock.lock();
+
+		busy.erase(busy.find(hi.getTorrent()));
+		cv_done.notify_all();
+	}
+}
 
-			HashSHA1 h;
-			unsigned int n = 0;
-			while (todo > 0) {
-				uint8_t chunk[HASHER_CHUNK_SIZE];
-				uint32_t chunk_len = std::min(todo, (unsigned int)HASHER_CHUNK_SIZE);
-				if (!torrent->readChunk(piecenum, n * HASHER_CHUNK_SIZE, chunk, chunk_len)) {
-					TRACE(HASHER, "torrent=%p,piece=%u,offset=%u,length=%u: read error", torrent, piecenum, n * HASHER_CHUNK_SIZE, chunk_len);
-				}
-				h.process(chunk, chunk_len);
-				todo -= chunk_len; n++;
-			}
-			bool ok = memcmp(h.getHash(), torrent->getPieceHash(piecenum), TORRENT_HASH_LEN) == 0;
-			TRACE(HASHER, "hashing completed: torrent=%p,piece=%u,ok=%u", torrent, piecenum, ok ? 1 : 0);
-			torrent->callbackCompleteHashing(piecenum, ok);
+void
+Hasher::hashPiece(HasherItem& hi)
+{
+	Torrent* torrent = hi.getTorrent();
+	unsigned int piecenum = hi.getPiece();
+	TRACE(HASHER, "hashing started: torrent=%p,piece=%u", torrent, piecenum);
+
+	unsigned int todo;
+	if (piecenum == torrent->getNumPieces() - 1) {
+		todo = torrent->getTotalSize() % torrent->getPieceLength();
+	} else {
+		todo = torrent->getPieceLength();
+	}
 
-			/* Relock the mutex */
-			lock.lock();
+	HashSHA1 h;
+	unsigned int n = 0;
+	PieceBuffer* pb = torrent->getPieceBuffer(piecenum);
+	if (pb != NULL) {
+		/*
+		 * Freshly downloaded; no need to go to disk as the piece is in memory.
+		 * Any chunks that arrived in order are already hashed, so continue
+		 * where the piece buffer left off.
+		 */
+		h = pb->getHasher();
+		h.process(pb->getData() + pb->getHashedLength(), pb->getLength() - pb->getHashedLength());
+		todo = 0;
+	}
+	while (todo > 0) {
+		uint8_t chunk[HASHER_CHUNK_SIZE];
+		uint32_t chunk_len = std::min(todo, (unsigned int)HASHER_CHUNK_SIZE);
+		if (!torrent->readChunk(piecenum, n * HASHER_CHUNK_SIZE, chunk, chunk_len)) {
+			TRACE(HASHER, "torrent=%p,piece=%u,offset=%u,length=%u: read error", torrent, piecenum, n * HASHER_CHUNK_SIZE, chunk_len);
 		}
+		h.process(chunk, chunk_len);
+		todo -= chunk_len; n++;
 	}
+	bool ok = memcmp(h.getHash(), torrent->getPieceHash(piecenum), TORRENT_HASH_LEN) == 0;
+	TRACE(HASHER, "hashing completed: torrent=%p,piece=%u,ok=%u", torrent, piecenum, ok ? 1 : 0);
+	torrent->callbackCompleteHashing(piecenum, ok);
 }
 
-/* Helper for removeRequestsFromPeer */
-class torrent_match {
-public:
-	torrent_match(Torrent* t) { torrent = t; }
-	bool operator () (HasherItem& hi) const {
-		return hi.getTorrent() == torrent;
+void
+Hasher::hashBatch(vector<HasherItem>& items)
+{
+	Torrent* torrent = items.front().getTorrent();
+	unsigned int pieceLen = torrent->getPieceLength();
+
+	/* Only the final piece can be shorter; hash it on its own */
+	vector<HasherItem> batch;
+	for (vector<HasherItem>::iterator it = items.begin(); it != items.end(); it++) {
+		if (it->getPiece() == torrent->getNumPieces() - 1 &&
+		    torrent->getTotalSize() % pieceLen != 0)
+			hashPiece(*it);
+		else
+			batch.push_back(*it);
+	}
+	if (batch.empty())
+		return;
+
+	TRACE(HASHER, "batch hashing started: torrent=%p,pieces=%u", torrent, (unsigned int)batch.size());
+	MultiHashSHA1 h(batch.size());
+	vector<uint8_t> chunks(batch.size() * HASHER_CHUNK_SIZE);
+	const uint8_t* bufs[MULTISHA1_MAX_LANES];
+	for (unsigned int i = 0; i < batch.size(); i++)
+		bufs[i] = &chunks[i * HASHER_CHUNK_SIZE];
+	for (unsigned int offset = 0; offset < pieceLen; offset += HASHER_CHUNK_SIZE) {
+		for (unsigned int i = 0; i < batch.size(); i++) {
+			if (!torrent->readChunk(batch[i].getPiece(), offset, &chunks[i * HASHER_CHUNK_SIZE], HASHER_CHUNK_SIZE)) {
+				TRACE(HASHER, "torrent=%p,piece=%u,offset=%u,length=%u: read error", torrent, batch[i].getPiece(), offset, HASHER_CHUNK_SIZE);
+			}
+		}
+		h.process(bufs, HASHER_CHUNK_SIZE);
 	}
 
-private:
-	Torrent* torrent;
-};
+	for (unsigned int i = 0; i < batch.size(); i++) {
+		unsigned int piecenum = batch[i].getPiece();
+		bool ok = memcmp(h.getHash(i), torrent->getPieceHash(piecenum), TORRENT_HASH_LEN) == 0;
+		TRACE(HASHER, "hashing completed: torrent=%p,piece=%u,ok=%u", torrent, piecenum, ok ? 1 : 0);
+		torrent->callbackCompleteHashing(piecenum, ok);
+	}
+}
 
 void
 Hasher::cancelTorrent(Torrent* t)
 {
 	unique_lock<mutex> lock(mtx_data);
-	hashQueue.remove_if(torrent_match(t));
+	freshQueue.removeTorrent(t);
+	recheckQueue.removeTorrent(t);
+
+	/* Wait until no thread is hashing a piece of the torrent anymore */
+	while (busy.find(t) != busy.end())
+		cv_done.wait(lock);
 }
 
 /* vim:set ts=2 sw=2: */
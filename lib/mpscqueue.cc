@@ -0,0 +1,62 @@
+#include "mpscqueue.h"
+
+using namespace std;
+using namespace boost;
+using namespace Tortilla;
+
+MPSCQueue::MPSCQueue()
+	: head(&stub), tail(&stub)
+{
+}
+
+void
+MPSCQueue::push(MPSCNode* node)
+{
+	node->mpsc_next.store(NULL, memory_order_relaxed);
+	MPSCNode* prev = head.exchange(node, memory_order_acq_rel);
+
+	/* Until this store, the consumer cannot see the node yet */
+	prev->mpsc_next.store(node, memory_order_release);
+}
+
+MPSCNode*
+MPSCQueue::pop()
+{
+	MPSCNode* t = tail;
+	MPSCNode* next = t->mpsc_next.load(memory_order_acquire);
+
+	/* Skip over the placeholder, if it's in front */
+	if (t == &stub) {
+		if (next == NULL)
+			return NULL;
+		tail = next; t = next;
+		next = next->mpsc_next.load(memory_order_acquire);
+	}
+	if (next != NULL) {
+		tail = next;
+		return t;
+	}
+
+	/* If someone is in the middle of pushing behind us, we'll have to wait */
+	if (t != head.load(memory_order_acquire))
+		return NULL;
+
+	/*
+	 * This is the final node; we need a successor before it can be removed, so
+	 * push the placeholder behind it.
+	 */
+	push(&stub);
+	next = t->mpsc_next.load(memory_order_acquire);
+	if (next == NULL)
+		return NULL;
+	tail = next;
+	return t;
+}
+
+bool
+MPSCQueue::empty() const
+{
+	return tail == &stub && head.load(memory_order_acquire) == &stub;
+}
+
+/* vim:set ts=2 sw=2: */
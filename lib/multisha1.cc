@@ -0,0 +1,327 @@
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include "cpufeatures.h"
+#include "multisha1.h"
+#include "sha1.h"
+#include "sha1impl.h"
+#ifdef SHA1_HAVE_X86
+#include <immintrin.h>
+#endif
+
+using namespace Tortilla;
+
+/*! \brief Processes a number of blocks of every lane
+ *  \param H Intermediate hash values, one column per lane
+ *  \param data Blocks to process, one pointer per lane
+ *  \param numBlocks Number of blocks to process per lane
+ */
+typedef void (*SHA1MultiFunction)(uint32_t (*H)[MULTISHA1_MAX_LANES], const uint8_t* const* data, size_t numBlocks);
+
+//! \brief Fallback which processes a single lane using the portable code
+static void
+sha1_multi_generic(uint32_t (*H)[MULTISHA1_MAX_LANES], const uint8_t* const* data, size_t numBlocks)
+{
+	uint32_t h[5];
+	for (int i = 0; i < 5; i++)
+		h[i] = H[i][0];
+	sha1_blocks_generic(h, data[0], numBlocks);
+	for (int i = 0; i < 5; i++)
+		H[i][0] = h[i];
+}
+
+//! \brief Round constants
+static const uint32_t sha1_K[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+
+#ifdef SHA1_HAVE_X86
+
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+static inline __m128i SSE2_TARGET
+rol_sse2(__m128i x, int n)
+{
+	return _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n));
+}
+
+//! \brief Converts four big-endian words to native ones; SSE2 lacks pshufb
+static inline __m128i SSE2_TARGET
+bswap_sse2(__m128i x)
+{
+	x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1);
+	return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+//! \brief Four lanes using SSE2
+static void SSE2_TARGET
+sha1_multi_sse2(uint32_t (*H)[MULTISHA1_MAX_LANES], const uint8_t* const* data, size_t numBlocks)
+{
+	__m128i h[5];
+	for (int i = 0; i < 5; i++)
+		h[i] = _mm_loadu_si128((const __m128i*)H[i]);
+
+	for (size_t n = 0; n < numBlocks; n++) {
+		/*
+		 * W holds the message schedule as a ring of sixteen words, each vector
+		 * containing the same word of all lanes; this takes a 4x4 transpose.
+		 */
+		__m128i W[16];
+		for (int j = 0; j < 4; j++) {
+			__m128i r0 = _mm_loadu_si128((const __m128i*)(data[0] + n * 64 + j * 16));
+			__m128i r1 = _mm_loadu_si128((const __m128i*)(data[1] + n * 64 + j * 16));
+			__m128i r2 = _mm_loadu_si128((const __m128i*)(data[2] + n * 64 + j * 16));
+			__m128i r3 = _mm_loadu_si128((const __m128i*)(data[3] + n * 64 + j * 16));
+			__m128i t0 = _mm_unpacklo_epi32(r0, r1), t1 = _mm_unpacklo_epi32(r2, r3);
+			__m128i t2 = _mm_unpackhi_epi32(r0, r1), t3 = _mm_unpackhi_epi32(r2, r3);
+			W[j * 4 + 0] = bswap_sse2(_mm_unpacklo_epi64(t0, t1));
+			W[j * 4 + 1] = bswap_sse2(_mm_unpackhi_epi64(t0, t1));
+			W[j * 4 + 2] = bswap_sse2(_mm_unpacklo_epi64(t2, t3));
+			W[j * 4 + 3] = bswap_sse2(_mm_unpackhi_epi64(t2, t3));
+		}
+
+		__m128i A = h[0], B = h[1], C = h[2], D = h[3], E = h[4];
+		for (int t = 0; t < 80; t++) {
+			if (t >= 16)
+				W[t & 15] = rol_sse2(_mm_xor_si128(
+				 _mm_xor_si128(W[(t - 3) & 15], W[(t - 8) & 15]),
+				 _mm_xor_si128(W[(t - 14) & 15], W[t & 15])), 1);
+			__m128i f;
+			if (t < 20)
+				f = _mm_xor_si128(D, _mm_and_si128(B, _mm_xor_si128(C, D)));
+			else if (t >= 40 && t < 60)
+				f = _mm_or_si128(_mm_and_si128(B, C), _mm_and_si128(D, _mm_or_si128(B, C)));
+			else
+				f = _mm_xor_si128(_mm_xor_si128(B, C), D);
+			__m128i temp = _mm_add_epi32(_mm_add_epi32(rol_sse2(A, 5), f),
+			 _mm_add_epi32(_mm_add_epi32(E, W[t & 15]), _mm_set1_epi32(sha1_K[t / 20])));
+			E = D; D = C; C = rol_sse2(B, 30); B = A; A = temp;
+		}
+		h[0] = _mm_add_epi32(h[0], A); h[1] = _mm_add_epi32(h[1], B);
+		h[2] = _mm_add_epi32(h[2], C); h[3] = _mm_add_epi32(h[3], D);
+		h[4] = _mm_add_epi32(h[4], E);
+	}
+
+	for (int i = 0; i < 5; i++)
+		_mm_storeu_si128((__m128i*)H[i], h[i]);
+}
+
+static inline __m256i AVX2_TARGET
+rol_avx2(__m256i x, int n)
+{
+	return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n));
+}
+
+//! \brief Eight lanes using AVX2
+static void AVX2_TARGET
+sha1_multi_avx2(uint32_t (*H)[MULTISHA1_MAX_LANES], const uint8_t* const* data, size_t numBlocks)
+{
+	const __m256i mask = _mm256_broadcastsi128_si256(
+	 _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3));
+	__m256i h[5];
+	for (int i = 0; i < 5; i++)
+		h[i] = _mm256_loadu_si256((const __m256i*)H[i]);
+
+	for (size_t n = 0; n < numBlocks; n++) {
+		/*
+		 * As with SSE2, but an 8x8 transpose: 4x4 transposes within each
+		 * 128-bit half first, then the halves of lanes 0-3 and 4-7 are merged.
+		 */
+		__m256i W[16];
+		for (int j = 0; j < 2; j++) {
+			__m256i u[4], v[4];
+			for (int half = 0; half < 2; half++) {
+				__m256i r[4];
+				for (int l = 0; l < 4; l++)
+					r[l] = _mm256_loadu_si256((const __m256i*)(data[half * 4 + l] + n * 64 + j * 32));
+				__m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]), t1 = _mm256_unpacklo_epi32(r[2], r[3]);
+				__m256i t2 = _mm256_unpackhi_epi32(r[0], r[1]), t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+				__m256i* o = half ? v : u;
+				o[0] = _mm256_unpacklo_epi64(t0, t1); o[1] = _mm256_unpackhi_epi64(t0, t1);
+				o[2] = _mm256_unpacklo_epi64(t2, t3); o[3] = _mm256_unpackhi_epi64(t2, t3);
+			}
+			for (int k = 0; k < 4; k++) {
+				W[j * 8 + k] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[k], v[k], 0x20), mask);
+				W[j * 8 + k + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[k], v[k], 0x31), mask);
+			}
+		}
+
+		__m256i A = h[0], B = h[1], C = h[2], D = h[3], E = h[4];
+		for (int t = 0; t < 80; t++) {
+			if (t >= 16)
+				W[t & 15] = rol_avx2(_mm256_xor_si256(
+				 _mm256_xor_si256(W[(t - 3) & 15], W[(t - 8) & 15]),
+				 _mm256_xor_si256(W[(t - 14) & 15], W[t & 15])), 1);
+			__m256i f;
+			if (t < 20)
+				f = _mm256_xor_si256(D, _mm256_and_si256(B, _mm256_xor_si256(C, D)));
+			else if (t >= 40 && t < 60)
+				f = _mm256_or_si256(_mm256_and_si256(B, C), _mm256_and_si256(D, _mm256_or_si256(B, C)));
+			else
+				f = _mm256_xor_si256(_mm256_xor_si256(B, C), D);
+			__m256i temp = _mm256_add_epi32(_mm256_add_epi32(rol_avx2(A, 5), f),
+			 _mm256_add_epi32(_mm256_add_epi32(E, W[t & 15]), _mm256_set1_epi32(sha1_K[t / 20])));
+			E = D; D = C; C = rol_avx2(B, 30); B = A; A = temp;
+		}
+		h[0] = _mm256_add_epi32(h[0], A); h[1] = _mm256_add_epi32(h[1], B);
+		h[2] = _mm256_add_epi32(h[2], C); h[3] = _mm256_add_epi32(h[3], D);
+		h[4] = _mm256_add_epi32(h[4], E);
+	}
+
+	for (int i = 0; i < 5; i++)
+		_mm256_storeu_si256((__m256i*)H[i], h[i]);
+}
+
+#endif /* SHA1_HAVE_X86 */
+
+/*! \brief Selects the widest implementation supported by the CPU
+ *  \param lanes Receives the number of lanes it processes
+ */
+static SHA1MultiFunction
+sha1_multi_select(unsigned int& lanes)
+{
+#ifdef SHA1_HAVE_X86
+	if (CPUFeatures::hasAVX2()) {
+		lanes = 8;
+		return sha1_multi_avx2;
+	}
+	if (CPUFeatures::hasSSE2()) {
+		lanes = 4;
+		return sha1_multi_sse2;
+	}
+#endif
+	lanes = 1;
+	return sha1_multi_generic;
+}
+
+static unsigned int sha1_multi_lanes;
+static SHA1MultiFunction sha1_multi_func = sha1_multi_select(sha1_multi_lanes);
+
+MultiHashSHA1::MultiHashSHA1(unsigned int numLanes)
+	: lanes(numLanes), length(0), tailLength(0), computed(false)
+{
+	assert(lanes > 0 && lanes <= MULTISHA1_MAX_LANES);
+	for (unsigned int l = 0; l < MULTISHA1_MAX_LANES; l++) {
+		H[0][l] = 0x67452301;
+		H[1][l] = 0xEFCDAB89;
+		H[2][l] = 0x98BADCFE;
+		H[3][l] = 0x10325476;
+		H[4][l] = 0xC3D2E1F0;
+	}
+}
+
+unsigned int
+MultiHashSHA1::getMaxLanes()
+{
+	return sha1_multi_lanes;
+}
+
+unsigned int
+MultiHashSHA1::getPreferredLanes()
+{
+	/* A single SHA-NI stream outruns any number of lanes */
+	if (sha1_multi_lanes == 1 || strcmp(HashSHA1::getImplementation(), "shani") == 0)
+		return 1;
+	return sha1_multi_lanes;
+}
+
+void
+MultiHashSHA1::processBlocks(const uint8_t* const* bufs, size_t numBlocks)
+{
+	/*
+	 * The implementation always processes all of its lanes; unused lanes just
+	 * process the first lane's data again and are ignored.
+	 */
+	for (unsigned int l = 0; l < lanes; l += sha1_multi_lanes) {
+		const uint8_t* ptrs[MULTISHA1_MAX_LANES];
+		for (unsigned int i = 0; i < sha1_multi_lanes; i++)
+			ptrs[i] = (l + i < lanes) ? bufs[l + i] : bufs[l];
+
+		/* Lanes are processed in groups; move the group's columns to the front */
+		uint32_t h[5][MULTISHA1_MAX_LANES];
+		for (int i = 0; i < 5; i++)
+			for (unsigned int j = 0; j < sha1_multi_lanes; j++)
+				h[i][j] = H[i][l + j];
+		sha1_multi_func(h, ptrs, numBlocks);
+		for (int i = 0; i < 5; i++)
+			for (unsigned int j = 0; j < sha1_multi_lanes && l + j < lanes; j++)
+				H[i][l + j] = h[i][j];
+	}
+}
+
+void
+MultiHashSHA1::process(const uint8_t* const* bufs, size_t size)
+{
+	assert(!computed);
+	length += size;
+
+	/* First complete any partial blocks */
+	size_t done = 0;
+	if (tailLength > 0) {
+		done = std::min(size, (size_t)(64 - tailLength));
+		for (unsigned int l = 0; l < lanes; l++)
+			memcpy(tail[l] + tailLength, bufs[l], done);
+		tailLength += done;
+		if (tailLength < 64)
+			return;
+
+		const uint8_t* ptrs[MULTISHA1_MAX_LANES];
+		for (unsigned int l = 0; l < lanes; l++)
+			ptrs[l] = tail[l];
+		processBlocks(ptrs, 1);
+		tailLength = 0;
+	}
+
+	/* Whole blocks are processed straight from the input */
+	size_t numBlocks = (size - done) / 64;
+	if (numBlocks > 0) {
+		const uint8_t* ptrs[MULTISHA1_MAX_LANES];
+		for (unsigned int l = 0; l < lanes; l++)
+			ptrs[l] = bufs[l] + done;
+		processBlocks(ptrs, numBlocks);
+		done += numBlocks * 64;
+	}
+
+	/* Keep whatever remains for later */
+	for (unsigned int l = 0; l < lanes; l++)
+		memcpy(tail[l], bufs[l] + done, size - done);
+	tailLength = size - done;
+}
+
+const uint8_t*
+MultiHashSHA1::getHash(unsigned int lane)
+{
+	assert(lane < lanes);
+	if (computed)
+		return hash[lane];
+
+	/*
+	 * All lanes have the same length, so they are padded identically: a one
+	 * bit, zeroes and the message length in bits, in one or two blocks.
+	 */
+	uint8_t pad[MULTISHA1_MAX_LANES][128];
+	unsigned int padLength = (tailLength < 56) ? 64 : 128;
+	uint64_t bits = length * 8;
+	const uint8_t* ptrs[MULTISHA1_MAX_LANES];
+	for (unsigned int l = 0; l < lanes; l++) {
+		memcpy(pad[l], tail[l], tailLength);
+		pad[l][tailLength] = 0x80;
+		memset(pad[l] + tailLength + 1, 0, padLength - tailLength - 1);
+		for (int i = 0; i < 8; i++)
+			pad[l][padLength - 1 - i] = (bits >> (i * 8)) & 0xff;
+		ptrs[l] = pad[l];
+	}
+	processBlocks(ptrs, padLength / 64);
+
+	for (unsigned int l = 0; l < lanes; l++) {
+		for (int i = 0; i < 5; i++) {
+			hash[l][i * 4 + 0] =  H[i][l] >> 24;
+			hash[l][i * 4 + 1] = (H[i][l] >> 16) & 0xff;
+			hash[l][i * 4 + 2] = (H[i][l] >>  8) & 0xff;
+			hash[l][i * 4 + 3] = (H[i][l] >>  0) & 0xff;
+		}
+	}
+	computed = true;
+	return hash[lane];
+}
+
+/* vim:set ts=2 sw=2: */
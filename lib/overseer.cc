@@ -6,6 +6,7 @@
 #include <string.h>
 #include <unistd.h>
 #include "callbacks.h"
+#include "connectionmanager.h"
 #include "filemanager.h"
 #include "receiver.h"
 #include "macros.h"
@@ -28,14 +29,13 @@ namespace Tortilla {
 	}
 }
 
-Overseer::Overseer(unsigned int portnum, Tracer* tr, Callbacks* cb)
+Overseer::Overseer(unsigned int portnum, Tracer* tr, Callbacks* cb, unsigned int numReceivers, unsigned int numHashers)
 {
 	terminating = false; port = portnum; tracer = tr;
 	if (cb == NULL)
 		callbacks = &dummy_callbacks;
 	else
 		callbacks = cb;
-	upload_rate = 0;
 
 	/*
 	 * Construct our peer ID; we do this in Azureus style and hereby claim the
@@ -49,9 +49,17 @@ Overseer::Overseer(unsigned int portnum, Tracer* tr, Callbacks* cb)
 		peerid[i] = rand() % 26 + 'a';
 
 	incoming = new Connection(port);
-	receiver = new Receiver(this);
-	hasher = new Hasher(this);
+	if (numReceivers == 0)
+		numReceivers = boost::thread::hardware_concurrency();
+	if (numReceivers == 0)
+		numReceivers = 1;
+	for (unsigned int i = 0; i < numReceivers; i++)
+		receivers.push_back(new Receiver(this, i == 0));
+	if (numHashers == 0)
+		numHashers = boost::thread::hardware_concurrency();
+	hasher = new Hasher(this, numHashers);
 	sender = new Sender(this);
+	connectionmanager = new ConnectionManager(this);
 	filemanager = new FileManager(this, 64 /* XXX make me configurable! */);
 
 	/* Block SIGPIPE - the appropriate thread will notice this anyway */
@@ -82,9 +90,12 @@ Overseer::~Overseer()
 	/* The overseer thread should have removed all torrents by now */
 	assert(torrents.size() == 0);
 
+	delete connectionmanager;
 	delete hasher;
 	delete sender;
-	delete receiver;
+	for (vector<Receiver*>::iterator it = receivers.begin();
+	     it != receivers.end(); it++)
+		delete *it;
 	delete incoming;
 	delete filemanager;
 }
@@ -160,9 +171,6 @@ Overseer::overseerThread()
 		tv.tv_sec = 1; tv.tv_usec = 0;
 		select(0, NULL, NULL, NULL, &tv);
 
-		/* Replenish amount of data transferrable */
-		sender->setAmountTransferrable(upload_rate);
-
 		/*
 		 * Tell all torrents to heartbeat and update their
 	 	 * bandwidth usage. This implies heartbeat() may not
@@ -224,30 +232,8 @@ Overseer::overseerThread()
 }
 
 void
-Overseer::handleIncomingConnection(Connection* c)
+Overseer::handleIncomingConnection(Connection* c, const uint8_t* handshake)
 {
-	fd_set fds;
-	struct timeval tv;
-	int fd = c->getFD();
-
-	tv.tv_sec = 3; tv.tv_usec = 0;
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
-	if (select(fd + 1, &fds, NULL, NULL, &tv) <= 0 || !FD_ISSET(fd, &fds)) {
-		/* No data! So sad... */
-		TRACE(NETWORK, "timeout waiting for handshake from %s", c->getEndpoint().c_str());
-		delete c;
-		return;
-	}
-
-	/*
-	 * Attempt to grab part one of the handshake; this consists of everything but
-	 * the peer id.
-	 */
-	uint8_t handshake[1024 /* XXX */];
-	c->read((void*)handshake, 1 + strlen(PEER_PSTR) + 8 + TORRENT_HASH_LEN, true);
-	TRACE(NETWORK, "got handshake (part 1): connection=%s", c->getEndpoint().c_str());
-	
 	/* So, we have part one of the handshake; dissect and validate it */
 	uint8_t reserved[8];
 	memcpy(reserved, (const char*)(handshake + 1 + strlen(PEER_PSTR)), 8);
@@ -284,28 +270,14 @@ Overseer::handleIncomingConnection(Connection* c)
 	 * OK, we have a handshake and we know the torrent. This means we can
 	 * accept the torrent, which we hereby do. Due to possible NAT
 	 * checking, it may be that we won't get the peer ID until after we
-	 * send our own handshake (the Peer constructor does this!) so do this and
-	 * then grab the peer ID (Why is this implemented this way?)
+	 * send our own handshake; the peer will pick it up once it arrives and
+	 * drop the connection if it turns out to be us.
 	 */
 	Peer* p = new Peer(t, c);
 
-	/*
-	 * We sent our stuff; wait for the final 20 bytes indicating the torrent's peer ID.
-	 */
-	c->read((void*)handshake, TORRENT_PEERID_LEN);
-	TRACE(NETWORK, "got handshake (part 2): connection=%p", c->getEndpoint().c_str());
-	string peer((const char*)(handshake), TORRENT_PEERID_LEN);
-	if (!memcmp(handshake, peerid, TORRENT_PEERID_LEN)) {
-		TRACE(NETWORK, "handshake aborted: connection=%p,peer=%s is us", c, c->getEndpoint().c_str());
-		delete p;
-		return;
-	}
-	p->setPeerID(peer);
-	TRACE(NETWORK, "handshake completed: connection=%p,peer=%s", c, p->getID().c_str());
-
 	/* We accept! We have no choice! */
 	t->registerPeer(p);
-	receiver->addPeer(p);
+	addPeer(p);
 	TRACE(NETWORK, "accepted peer %p for torrent %p",
 	 c, t);
 
@@ -340,9 +312,9 @@ Overseer::findTorrent(const uint8_t* hash) const
  */
 
 void
-Overseer::queueHashPiece(Torrent* t, uint32_t piece)
+Overseer::queueHashPiece(Torrent* t, uint32_t piece, bool recheck)
 {
-	hasher->addPiece(t, piece);
+	hasher->addPiece(t, piece, recheck);
 }
 
 void
@@ -352,51 +324,70 @@ Overseer::cancelHashing(Torrent* t)
 }
 
 void
-Overseer::signalSender()
+Overseer::signalSender(int fd)
+{
+	sender->signal(fd);
+}
+
+void
+Overseer::removeSenderPeer(int fd)
+{
+	sender->removePeer(fd);
+}
+
+void
+Overseer::connectPeer(PendingPeer* pp)
 {
-	sender->signal();
+	connectionmanager->connect(pp);
+}
+
+void
+Overseer::cancelConnecting(Torrent* t)
+{
+	connectionmanager->cancelTorrent(t);
+}
+
+void
+Overseer::connectionDone()
+{
+	connectionmanager->connectionDone();
 }
 
 void
 Overseer::addPeer(Peer* p)
 {
-	receiver->addPeer(p);
+	getReceiver(p->getFD())->addPeer(p);
+	sender->addPeer(p->getFD());
 }
 
 void
 Overseer::removePeer(Peer* p)
 {
-	receiver->removePeer(p);
+	getReceiver(p->getFD())->removePeer(p);
 }
 
 void
 Overseer::addRequest(HTTPRequest* r)
 {
-	receiver->addRequest(r);
+	getReceiver(r->getFD())->addRequest(r);
 }
 
 void
 Overseer::removeRequest(HTTPRequest* r)
 {
-	receiver->removeRequest(r);
+	getReceiver(r->getFD())->removeRequest(r);
 }
 
 Peer*
 Overseer::findPeerByFDAndLock(int fd)
 {
-	return receiver->findPeerByFDAndLock(fd);
+	return getReceiver(fd)->findPeerByFDAndLock(fd);
 }
 
 void 
 Overseer::removePeerByFD(int fd)
 {
-	return receiver->removePeerByFD(fd);
-}
-
-void
-Overseer::getSendablePeers(list<int>& m)
-{
-	return receiver->getSendablePeers(m);
+	return getReceiver(fd)->removePeerByFD(fd);
 }
 
 
@@ -424,4 +415,16 @@ Overseer::readFile(File* f, off_t offset, void* buf, size_t len)
 	filemanager->readFile(f, offset, buf, len);
 }
 
+ssize_t
+Overseer::sendFile(File* f, int sockfd, off_t offset, size_t len)
+{
+	return filemanager->sendFile(f, sockfd, offset, len);
+}
+
+void
+Overseer::prefetchFile(File* f, off_t offset, size_t len)
+{
+	filemanager->prefetchFile(f, offset, len);
+}
+
 /* vim:set ts=2 sw=2: */
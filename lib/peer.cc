@@ -23,16 +23,15 @@ Peer::__init(Torrent* t)
 	torrent = t; am_choked = true; am_interested = false;
 	peer_choked = true; peer_interested = false;
 	command_buffer_readpos = 0; command_buffer_writepos = 0;
+	command_buffer_len = 0;
 	/* ensure we don't kick the peer immediately due to timeout */
 	lastTime = time(NULL);
-	numPeerPieces = 0; rx_bytes = 0; tx_bytes = 0;
+	numPeerPieces = 0; numWantedPieces = 0; rx_bytes = 0; tx_bytes = 0;
 	rx_total = 0; tx_total = 0;
 	peerID = ""; terminating = false;
 
 	/* Assume the peer doesn't have any pieces */
-	havePiece.reserve(t->getNumPieces());
-	for (unsigned int i = 0; i < t->getNumPieces(); i++)
-		havePiece.push_back(false);
+	havePiece.resize(t->getNumPieces());
 }
 
 Peer::Peer(Torrent* t, std::string peer_id, std::string peer_host, uint16_t peer_port)
@@ -42,7 +41,7 @@ Peer::Peer(Torrent* t, std::string peer_id, std::string peer_host, uint16_t peer
 	incoming = false;
 
 	/* This connection is outgoing, so we need to handle the handshaking process */
-	handshaking = true;
+	handshaking = true; awaiting_peerid = false;
 	launchTime = time(NULL);
 }
 
@@ -52,8 +51,11 @@ Peer::Peer(Torrent* t, Connection* c)
 	connection = c;
 	incoming = true;
 
-	/* This connection is incoming, so all we need to do is send our handshake / bitfield */
-	handshaking = false;
+	/*
+	 * This connection is incoming, so all we need to do is send our handshake /
+	 * bitfield and wait for the peer ID to arrive.
+	 */
+	handshaking = false; awaiting_peerid = true;
 	launchTime = time(NULL);
 }
 
@@ -64,17 +66,6 @@ Peer::~Peer()
 	/* First of all, ensure we are marked as terminating */
 	shutdown();
 
-	/* Get rid of all outstanding requests; these will not be serviced */
-	{
-		unique_lock<shared_mutex> lock(rwl_send_queue);
-		while(!send_queue.empty()) {
-			SenderRequest* sr = send_queue.front();
-			send_queue.pop_front();
-			delete sr;
-		}
-		send_queue.clear();
-	}
-
 	/*
 	 * We force the shutdown state to be set, and then consequently, we attempt
 	 * to grab the sending lock. If we stall, this means the Sender is servicing
@@ -86,63 +77,76 @@ Peer::~Peer()
 	{
 		unique_lock<mutex> lock(mtx_sending);
 
+		/* Get rid of all outstanding requests; these will not be serviced */
+		fetchSenderRequests();
+		while(!control_queue.empty()) {
+			SenderRequest* sr = control_queue.front();
+			control_queue.pop_front();
+			delete sr;
+		}
+		while(!bulk_queue.empty())
+			delete dequeueUpload();
+
 		/* We need to deregister all of our pieces */
-		for (unsigned int i = 0; i < torrent->getNumPieces(); i++)
-			if (havePiece[i])
-				lostPieces.push_back(i);
+		for (size_t i = havePiece.findNext(); i < havePiece.size(); i = havePiece.findNext(i + 1))
+			lostPieces.push_back(i);
 		torrent->callbackPiecesRemoved(this, lostPieces);
 
+		/* If we never got connected, the attempt is over now */
+		if (connection->areConnecting())
+			torrent->callbackPeerConnected(this);
 		delete connection;
 	}
 }
 
-#define DATA_LEFT \
-		((command_buffer_readpos < command_buffer_writepos) ? \
-			(command_buffer_writepos - command_buffer_readpos) : \
-			((PEER_BUFFER_SIZE - command_buffer_readpos) + command_buffer_writepos))
+int
+Peer::getReceiveBuffers(struct iovec* iov)
+{
+	/*
+	 * Free space starts at the write position and may wrap around to the
+	 * beginning of the buffer, up to the read position.
+	 */
+	uint32_t space = PEER_BUFFER_SIZE - command_buffer_len;
+	if (space == 0)
+		return 0;
+
+	uint32_t chunk = std::min(space, PEER_BUFFER_SIZE - command_buffer_writepos);
+	iov[0].iov_base = (void*)(command_buffer + command_buffer_writepos);
+	iov[0].iov_len = chunk;
+	if (chunk == space)
+		return 1;
+
+	iov[1].iov_base = (void*)command_buffer;
+	iov[1].iov_len = space - chunk;
+	return 2;
+}
+
+void
+Peer::consumeCommandBuffer(uint32_t len)
+{
+	assert(len <= command_buffer_len);
+	command_buffer_readpos = (command_buffer_readpos + len) % PEER_BUFFER_SIZE;
+	command_buffer_len -= len;
+}
 
 bool
-Peer::receive(const uint8_t* data, uint32_t data_len)
+Peer::receive(uint32_t data_len)
 {
 	assert (data_len > 0);
+	assert (data_len <= PEER_BUFFER_SIZE - command_buffer_len);
 	{
 		unique_lock<mutex> lock(mtx_data);
 		rx_bytes += data_len;
 	}
-
-	/*
-	 * First of all, check how much data we can still place into the buffer. If we run
-	 * out, this means the client is trying to send a too large message, and we'd
-	 * better give up.
-	 */
-	if (((PEER_BUFFER_SIZE - command_buffer_writepos) + command_buffer_readpos) < data_len) {
-		TRACE(NETWORK, "out of space to store data received from peer=%s, closing connection",
-		 getID().c_str());
-		return true;
-	}
 	lastTime = time(NULL);
 
-	/*
-	 * Need to store the peer's data now. First of all, try to use the chunk from
-	 * write_pos ... buffer_size.
-	 */
-	uint32_t write_chunk = std::min((PEER_BUFFER_SIZE - command_buffer_writepos), data_len);
-	memcpy((uint8_t*)(command_buffer + command_buffer_writepos), data, write_chunk);
-	data_len -= write_chunk; data += write_chunk;
-	command_buffer_writepos = (command_buffer_writepos + write_chunk) % PEER_BUFFER_SIZE;
-
-	/*
-	 * If we still have data to write, we this means we need to write to the
-	 * part 0 ... read_pos, which is unused as well.
-	 */
-	if (data_len > 0) {
-		memcpy((uint8_t*)(command_buffer + command_buffer_writepos), data, data_len);
-		command_buffer_writepos = (command_buffer_writepos + data_len) % PEER_BUFFER_SIZE;
-	}
+	/* The data is already in place; just account for it */
+	command_buffer_writepos = (command_buffer_writepos + data_len) % PEER_BUFFER_SIZE;
+	command_buffer_len += data_len;
 
 	/* All data is in place; try to handle commands! */
 	while (1) {
-		uint32_t data_left = DATA_LEFT;
+		uint32_t data_left = command_buffer_len;
 		if (handshaking) {
 			/* Only continue if we have at least the entire handshake string */
 			int pstrlen = strlen(PEER_PSTR);
@@ -154,7 +158,7 @@ Peer::receive(const uint8_t* data, uint32_t data_len)
 			}
 
 			/* XXX we assume the buffer doesn't wrap yet */
-			data = (uint8_t*)(command_buffer + command_buffer_readpos);
+			const uint8_t* data = (const uint8_t*)(command_buffer + command_buffer_readpos);
 			if (data[0] != pstrlen) {
 				TRACE(PROTOCOL, "receive: peer=%s sent illegal header length %u (!= %u), dropping",
 				 getID().c_str(), data[0], pstrlen);
@@ -186,13 +190,36 @@ Peer::receive(const uint8_t* data, uint32_t data_len)
 			 * a bit useless anyway.
 			 */
 			handshaking = false;
-			command_buffer_readpos = (command_buffer_readpos + handshake_len) % PEER_BUFFER_SIZE;
+			consumeCommandBuffer(handshake_len);
 			data_left -= handshake_len;
 
 			/* Handshaking is done - send our bitfield, if needed */
 			sendBitfield();
 		}
 
+		if (awaiting_peerid) {
+			/*
+			 * Incoming connection; the overseer handled the first part of the
+			 * handshake, so all that is left is the peer ID.
+			 */
+			if (data_left < TORRENT_PEERID_LEN)
+				return false;
+
+			char id[TORRENT_PEERID_LEN];
+			for (unsigned int i = 0; i < TORRENT_PEERID_LEN; i++)
+				id[i] = command_buffer[(command_buffer_readpos + i) % PEER_BUFFER_SIZE];
+			if (!memcmp(id, torrent->getPeerID(), TORRENT_PEERID_LEN)) {
+				TRACE(PROTOCOL, "handshaking: peer=%s is us, dropping connection!", getID().c_str());
+				return true;
+			}
+			setPeerID(string(id, TORRENT_PEERID_LEN));
+			TRACE(NETWORK, "handshake completed: peer=%s", getID().c_str());
+
+			awaiting_peerid = false;
+			consumeCommandBuffer(TORRENT_PEERID_LEN);
+			data_left -= TORRENT_PEERID_LEN;
+		}
+
 		/* Only try something if we have at least the length */
 		if (data_left < 4)
 			break;
@@ -216,8 +243,8 @@ Peer::receive(const uint8_t* data, uint32_t data_len)
 			);
 		if (len == 0) {
 			/* Keepalive; skip the length bytes and continue */
-			command_buffer_readpos = (command_buffer_readpos + 4) % PEER_BUFFER_SIZE;
-			if (command_buffer_readpos == command_buffer_writepos) {
+			consumeCommandBuffer(4);
+			if (command_buffer_len == 0) {
 				command_buffer_readpos = 0; command_buffer_writepos = 0;
 				break;
 			}
@@ -225,7 +252,7 @@ Peer::receive(const uint8_t* data, uint32_t data_len)
 		}
 
 		/* If the peer tries to send a crazy amount of data, lose it */
-		if (len > 65536) {
+		if (len > PEER_MAX_MESSAGE_LENGTH) {
 			TRACE(NETWORK, "receive: peer=%s is sending an extremely long message of %u bytes, closing connection", getID().c_str(), len);
 			return true;
 		}
@@ -240,11 +267,11 @@ Peer::receive(const uint8_t* data, uint32_t data_len)
 		 * We have a complete message of at least one byte. Throw away the length
 		 * prefix as we have stored it already.
 		 */
-		command_buffer_readpos = (command_buffer_readpos + 4) % PEER_BUFFER_SIZE;
+		consumeCommandBuffer(4);
 
 		/* Extract the message ID and data payload */
 		uint8_t msg = command_buffer[command_buffer_readpos];
-		command_buffer_readpos = (command_buffer_readpos + 1) % PEER_BUFFER_SIZE;
+		consumeCommandBuffer(1);
 
 		len--; /* skip command */
 
@@ -253,42 +280,23 @@ Peer::receive(const uint8_t* data, uint32_t data_len)
 			/*
 			 * This message has arguments that expand past the end of the buffer
 			 * (i.e. they are stored at the beginning). As we need to pass the
-			 * payload sequentially, we need to copy the two parts in place.
-			 *
-			 *          +----------------+
-			 *          |2222222222222222|
-			 *          +----------------+ <-- mark = (readpos + len) % SIZE
-			 *          |                |
-			 *          |                | mark <= writepos <= readpos
-			 *          |                |
-			 *          +----------------+ <-- readpos
-			 *          |1111111111111111| pre = SIZE - readpos
-			 *          +----------------+
-			 *
-			 * We need to rewrite this to:
+			 * payload sequentially, we copy the wrapped part to the slack area
+			 * which directly follows the buffer.
 			 *
 			 *          +----------------+
-			 *          |                |
-			 *          |                |
-			 *          |1111111111111111| <-- length = pre
-			 *          |2222222222222222| <-- length = mark
+			 *          |2222222222222222| --+
+			 *          +----------------+   |
+			 *          |                |   |
+			 *          +----------------+   |
+			 *          |1111111111111111|   | <-- readpos
+			 *          +================+   |
+			 *          |2222222222222222| <-+ slack, length = mark
 			 *          +----------------+
 			 *
-			 * Note: mark + pre == len
+			 * Only the wrapped part is copied; the first part stays where it is.
 			 */
-			uint32_t pre = PEER_BUFFER_SIZE - command_buffer_readpos;
-			uint32_t mark = (command_buffer_readpos + len) % PEER_BUFFER_SIZE;
-
-			/* Ensure we will not overwrite unprocessed written data */
-			assert(command_buffer_writepos < PEER_BUFFER_SIZE - len);
-
-			/*
-			 * Place the entire packet at size - len ... size of the buffer; this is
-			 * guaranteed to be unused by the previous assertion.
-			 */
-			memcpy((uint8_t*)(command_buffer + PEER_BUFFER_SIZE - len), (command_buffer + command_buffer_readpos), pre);
-			memcpy((uint8_t*)(command_buffer + PEER_BUFFER_SIZE - len + pre), (command_buffer), mark);
-			ptr = (const uint8_t*)(command_buffer + PEER_BUFFER_SIZE - len);
+			uint32_t mark = (command_buffer_readpos + len) - PEER_BUFFER_SIZE;
+			memcpy((uint8_t*)(command_buffer + PEER_BUFFER_SIZE), command_buffer, mark);
 		}
 
 		bool disconnect;
@@ -331,10 +339,10 @@ Peer::receive(const uint8_t* data, uint32_t data_len)
 			return true;
 
 		/* Remove message payload from the input buffer */
-		command_buffer_readpos = (command_buffer_readpos + len) % PEER_BUFFER_SIZE;
+		consumeCommandBuffer(len);
 
 		/* If we ran out of data, wait until more arrives */
-		if (command_buffer_readpos == command_buffer_writepos) {
+		if (command_buffer_len == 0) {
 			/*
 			 * Reset the buffer to the start. While this makes no difference from a
 			 * correctness point of view, it generally removes the need for message
@@ -348,7 +356,6 @@ Peer::receive(const uint8_t* data, uint32_t data_len)
 	return false;
 }
 
-#undef DATA_LEFT
 
 bool
 Peer::msgChoke()
@@ -356,6 +363,17 @@ Peer::msgChoke()
 	TRACE(PROTOCOL, "choke: peer=%s", getID().c_str());
 	am_choked = true;
 
+	/*
+	 * The peer discards any requests we made once it chokes us, so they can be
+	 * requested from someone else.
+	 */
+	set<OutstandingChunkRequest> dropped;
+	{
+		unique_lock<mutex> lock(mtx_data);
+		dropped.swap(chunk_requests);
+	}
+	torrent->callbackChunkRequestsDropped(this, dropped);
+
 	torrent->callbackPeerChangedChoking(this);
 	return false;
 }
@@ -406,10 +424,9 @@ Peer::msgHave(const uint8_t* msg, uint32_t len)
 		return true;
 
 	if (!havePiece[index]) {
-		havePiece[index] = true;
 		numPeerPieces++;
 
-		/* Update the torrent state too - this is to increment cardinality */
+		/* The torrent will mark the piece; this is to increment cardinality too */
 		std::vector<unsigned int> pieces;
 		pieces.push_back(index);
 		torrent->callbackPiecesAdded(this, pieces);
@@ -431,22 +448,19 @@ Peer::msgBitfield(const uint8_t* msg, uint32_t len)
 		return true;
 
 	/*
-	 * Wade through the bits and wack our own as needed: bit 7 represents
-	 * piece n, bit 6 piece n + 1 etc, so we generally need to invert the
-	 * pattern (this is the reason we use a vector of bool, so we don't need
-	 * to worry about this stuff elsewhere)
+	 * Take the bits as they are and only walk the pieces the peer has; the
+	 * bitfield deals with the bit order.
 	 */
+	Bitfield pieces(numPieces);
+	pieces.load(msg);
 	vector<unsigned int> newPieces;
-	for (unsigned int i = 0; i < numPieces; i++) {
-		havePiece[i] = msg[i / 8] & (1 << (7 - (i % 8)));
-		if (havePiece[i]) {
-			newPieces.push_back(i);
-			numPeerPieces++;
-		}
-	}
+	newPieces.reserve(pieces.count());
+	for (size_t i = pieces.findNext(); i < pieces.size(); i = pieces.findNext(i + 1))
+		newPieces.push_back(i);
+	numPeerPieces = newPieces.size();
 	TRACE(PROTOCOL, "bitfield: peer=%s, pieces=%u", getID().c_str(), numPeerPieces);
 
-	/* Inform the torrent class of all added pieces */
+	/* Inform the torrent class of all added pieces; it will mark them */
 	torrent->callbackPiecesAdded(this, newPieces);
 	return false;
 }
@@ -466,6 +480,23 @@ Peer::msgRequest(const uint8_t* msg, uint32_t len)
 		/* Disconnect the peer; no sense making them wait for things we're never going to give */
 		return true;
 	}
+	if (index >= torrent->getNumPieces() || (uint64_t)begin + length > torrent->calculatePieceLength(index)) {
+		TRACE(PROTOCOL, "ignoring request of peer=%s, index=%u, begin=%u: out of range", getID().c_str(), index, begin);
+		return true;
+	}
+
+	/*
+	 * Requests may cross our choke message on the wire, so don't hold that
+	 * against the peer; just drop them, as the peer will.
+	 */
+	if (peer_choked) {
+		TRACE(PROTOCOL, "ignoring request of peer=%s, index=%u: peer is choked", getID().c_str(), index);
+		return false;
+	}
+	if (!torrent->canUploadPiece(index)) {
+		TRACE(PROTOCOL, "ignoring request of peer=%s, index=%u: piece not available", getID().c_str(), index);
+		return false;
+	}
 
 	queueSenderRequest(new SenderRequest(getTorrent(), index, begin, length));
 	return false;
@@ -483,10 +514,13 @@ Peer::msgPiece(const uint8_t* msg, uint32_t len)
 	len -= 8;
 	TRACE(PROTOCOL, "piece: peer=%s, index=%u, begin=%u, length=%u", getID().c_str(), index, begin, len);
 
+	bool requested;
 	{
 		unique_lock<mutex> lock(mtx_data);
-		chunk_requests.remove(OutstandingChunkRequest(index, begin, len));
+		requested = chunk_requests.erase(OutstandingChunkRequest(index, begin, len)) > 0;
 	}
+	if (requested)
+		torrent->callbackChunkRequestDone(this, index, begin);
 
 	if (len > TORRENT_CHUNK_SIZE || begin % TORRENT_CHUNK_SIZE != 0) {
 		/*
@@ -550,16 +584,16 @@ Peer::revokeInterest()
 void
 Peer::queueSenderRequest(SenderRequest* sr)
 {
-	if (terminating)
+	if (terminating) {
+		delete sr;
 		return;
-
-	{
-		unique_lock<shared_mutex> lock(rwl_send_queue);
-		send_queue.push_back(sr);
 	}
 
+	/* The sender sorts the request into the appropriate queue */
+	send_inbox.push(sr);
+
 	/* If the sender is sleeping, awaken it */
-	torrent->signalSender();
+	torrent->signalSender(getFD());
 }
 
 bool
@@ -583,10 +617,11 @@ Peer::sendPieceRequest(unsigned int piece)
 	if (!torrent->isEndgameMode() && chunk_requests.size() > 0)
 		return -1;
 #endif
-	if (chunk_requests.size() >= PEER_MAX_OUTSTANDING_REQUESTS)
+	unsigned int maxRequests = getMaxOutstandingRequests();
+	if (chunk_requests.size() >= maxRequests)
 		return -1;
 
-	while (chunk_requests.size() < PEER_MAX_OUTSTANDING_REQUESTS) {
+	while (chunk_requests.size() < maxRequests) {
 		/* If we are requesting a piece, the peer should have it */
 		assert(havePiece[piece] == true);
 
@@ -624,13 +659,28 @@ Peer::sendPieceRequest(unsigned int piece)
 
 		{
 			unique_lock<mutex> lock(mtx_data);
-			chunk_requests.push_back(OutstandingChunkRequest(piece, missingChunk * TORRENT_CHUNK_SIZE, request_length));
+			chunk_requests.insert(OutstandingChunkRequest(piece, missingChunk * TORRENT_CHUNK_SIZE, request_length));
 		}
 		numRequested++;
 	}
 	return numRequested;
 }
 
+unsigned int
+Peer::getMaxOutstandingRequests() const
+{
+	uint32_t rate = torrent->getDownloadRate();
+	uint32_t global_rate = torrent->overseer->getDownloadRate();
+	if (rate == 0 || (global_rate > 0 && global_rate < rate))
+		rate = global_rate;
+	if (rate == 0)
+		return PEER_MAX_OUTSTANDING_REQUESTS;
+
+	/* Always keep at least a single request outstanding */
+	unsigned int num = (uint64_t)rate * PEER_REQUEST_BACKLOG_TIME / TORRENT_CHUNK_SIZE;
+	return std::max(1u, std::min(num, (unsigned int)PEER_MAX_OUTSTANDING_REQUESTS));
+}
+
 void
 Peer::sendHandshake()
 {
@@ -669,15 +719,10 @@ Peer::sendBitfield()
 	 * Construct a bitfield mask for the other peer: bit 7 represents
 	 * piece n, bit 6 piece n + 1 etc.
 	 */
-	unsigned int numAvailable = 0;
+	Bitfield pieces = torrent->getPieceMap();
+	unsigned int numAvailable = pieces.count();
 	uint8_t* bitfield = new uint8_t[bitfieldLen];
-	memset(bitfield, 0, bitfieldLen);
-	for (unsigned int i = 0; i < numPieces; i++) {
-		if (torrent->hasPiece(i)) {
-			bitfield[i / 8] |= 1 << (7 - (i % 8));
-			numAvailable++;
-		}
-	}
+	pieces.store(bitfield);
 
 	/* Only send something if there is something to report */
 	if (numAvailable > 0) {
@@ -690,94 +735,280 @@ Peer::sendBitfield()
 }
 
 size_t
-Peer::processSenderQueue(ssize_t max_length)
+Peer::processSenderQueue(ssize_t max_length, bool& would_block, bool& drained)
 {
 	size_t total = 0;
+	would_block = false;
 
-	/* XXX we will empty the queue if we can; if this fair? */
+	/* The sender limits how much we may send to keep things fair among peers */
 	while (!terminating && max_length != 0) {
+		fetchSenderRequests();
+		prefetchUploads();
+
 		/*
-		 * Attempt to fetch an item from the queue. Note that we immediately remove
-		 * the item to prevent others from destroying it.
+		 * Fetch as many items from the queues as we can send in one go.
+		 *
+		 * Control messages go first, unless we are in the middle of sending a
+		 * piece; messages cannot be interleaved. Anything stored in a file must
+		 * be sent on its own, so we stop there.
 		 */
-		SenderRequest* request;
+		vector<SenderRequest*> requests;
 		{
-			unique_lock<shared_mutex> lock(rwl_send_queue);
-			if (send_queue.empty())
-				break;
-			request = send_queue.front();
-			send_queue.pop_front();
+			size_t len = 0;
+			bool partial = !bulk_queue.empty() && bulk_queue.front()->isPartialRequest();
+			while (requests.size() < PEER_MAX_GATHER) {
+				if (max_length >= 0 && len >= (size_t)max_length)
+					break;
+				SenderRequest* sr;
+				if (partial || control_queue.empty()) {
+					if (bulk_queue.empty())
+						break;
+					sr = dequeueUpload();
+				} else {
+					sr = control_queue.front();
+					control_queue.pop_front();
+				}
+				requests.push_back(sr);
+				len += sr->getMessageLength();
+				if (sr->getMemoryLength() < sr->getMessageLength())
+					break;
+			}
 		}
+		if (requests.empty())
+			break;
 
-		uint32_t sending_len = request->getMessageLength();
-		if (max_length >= 0 && (ssize_t)sending_len > max_length) {
-			/* This will be a partial request */
-			sending_len = max_length;
-		}
+		ssize_t written = sendRequests(requests, max_length);
 
-		ssize_t written = connection->write(request->getMessage(), sending_len);
+		/* Hand out the bytes written to the requests, in order */
+		size_t left = (written > 0) ? written : 0;
+		vector<SenderRequest*>::iterator it = requests.begin();
+		for (/* nothing */; it != requests.end(); it++) {
+			SenderRequest* sr = *it;
+			size_t len = std::min(left, (size_t)sr->getMessageLength());
+			left -= len;
 
-		/* First of all, update counters if the request isn't cancelled */
-		if (written > 0) {
 			/*
 			 * Only increment uploaded bytes if this was a request to upload data to
 			 * a peer.
 			 */
-			if (request->getPieceLength() > 0)
-				torrent->incrementUploadedBytes(written);
-			total += written; tx_bytes += written;
-			if (max_length >= 0)
-				max_length -= written;
+			if (sr->haveData() && len > 0)
+				torrent->incrementUploadedBytes(len);
+
+			if (len < sr->getMessageLength()) {
+				/* We have written only a part, which we should skip the next time */
+				sr->skip(len);
+				break;
+			}
+
+			/* We have written exactly the amount of data, so this request is done! */
+			delete sr;
 		}
 
-		if ((size_t)written == request->getMessageLength()) {
-			/*
-			 * We have written exactly the amount of data, or the request was
-			 * cancelled, so this request is done!
-			 */
-			delete request;
-			request = NULL;
-		} else {
-			/* We have written at least a single byte, which we should skip the next time */
-			if (written > 0)
-				request->skip(written);
-
-			/* Re-add the item at the beginning of the queue (!) */
-			{
-				unique_lock<shared_mutex> lock(rwl_send_queue);
-				send_queue.push_front(request);
+		/* Re-add any remaining items at the beginning of their queue (!), keeping their order */
+		bool done = (it == requests.end());
+		if (!done) {
+			for (vector<SenderRequest*>::iterator it2 = requests.end(); it2 != it; /* nothing */) {
+				SenderRequest* sr = *--it2;
+				if (sr->haveData())
+					queueUpload(sr, true);
+				else
+					control_queue.push_front(sr);
 			}
 		}
 
-		/* If the previous sending effort failed, bail; any subsequent won't work either */
-		if (written <= 0)
+		if (written > 0) {
+			total += written; tx_bytes += written;
+			if (max_length >= 0)
+				max_length -= written;
+		}
+
+		/*
+		 * If we couldn't send everything, bail; any subsequent effort won't work
+		 * either. Unless we hit our limit, this means the socket is full.
+		 */
+		if (!done) {
+			would_block = (max_length != 0) && !terminating;
 			break;
+		}
 	}
+	drained = terminating || isSenderQueueEmpty();
+
+	/* Account for what we sent while the peer cannot go away */
+	upload_bucket.consume(total);
+	torrent->upload_bucket.consume(total);
 
 	/* We are done sending */
 	mtx_sending.unlock();
 	return total;
 }
 
+ssize_t
+Peer::getUploadAllowance(uint64_t& delay)
+{
+	uint64_t peer_delay = 0, torrent_delay = 0;
+	ssize_t peer_allowance = upload_bucket.getAvailable(peer_delay);
+	ssize_t torrent_allowance = torrent->upload_bucket.getAvailable(torrent_delay);
+	ssize_t allowance = TokenBucket::limit(peer_allowance, torrent_allowance);
+	if (allowance == 0)
+		delay = std::max(peer_delay, torrent_delay);
+	return allowance;
+}
+
+ssize_t
+Peer::sendRequests(const vector<SenderRequest*>& requests, ssize_t max_length)
+{
+	/* Gather everything we have in memory, up to the maximum length */
+	struct iovec iov[PEER_MAX_GATHER];
+	int iovcnt = 0;
+	size_t iov_len = 0;
+	for (vector<SenderRequest*>::const_iterator it = requests.begin();
+	     it != requests.end(); it++) {
+		size_t len = (*it)->getMemoryLength();
+		if (max_length >= 0)
+			len = std::min(len, (size_t)max_length - iov_len);
+		if (len == 0)
+			continue;
+		iov[iovcnt].iov_base = (void*)(*it)->getMessage();
+		iov[iovcnt].iov_len = len;
+		iovcnt++; iov_len += len;
+	}
+
+	/*
+	 * Only the final request can have data in a file; if so, tell the OS more is
+	 * coming so the header and data can share a segment.
+	 */
+	SenderRequest* last = requests.back();
+	size_t file_len = last->getMessageLength() - last->getMemoryLength();
+	if (max_length >= 0)
+		file_len = std::min(file_len, (size_t)max_length - iov_len);
+
+	ssize_t written = 0;
+	if (iovcnt > 0) {
+		written = connection->writev(iov, iovcnt, file_len > 0);
+		if (written < (ssize_t)iov_len)
+			return written;
+	}
+	if (file_len == 0)
+		return written;
+
+	/*
+	 * Piece data is sent straight from the files. If that fails, there is no
+	 * point in trying again once the socket is writable; this happens if the
+	 * connection is gone, or if the file is shorter than it should be.
+	 */
+	ssize_t sent = torrent->sendChunk(getFD(), last->getPiece(), last->getUploadOffset(), file_len);
+	if (sent < 0) {
+		TRACE(NETWORK, "unable to send piece data, dropping peer: peer=%s, piece=%u, offset=%u", getID().c_str(), last->getPiece(), last->getUploadOffset());
+		shutdown();
+		return written;
+	}
+	return written + sent;
+}
+
 void
-Peer::cancelChunkRequest(unsigned int piece, unsigned int offset, unsigned int length)
+Peer::queueUpload(SenderRequest* sr, bool front)
+{
+	list<SenderRequest*>::iterator it;
+	if (front) {
+		bulk_queue.push_front(sr);
+		it = bulk_queue.begin();
+	} else {
+		it = bulk_queue.insert(bulk_queue.end(), sr);
+	}
+	upload_index.insert(make_pair(make_pair(sr->getPiece(), sr->getOffset()), it));
+}
+
+list<SenderRequest*>::iterator
+Peer::removeUpload(list<SenderRequest*>::iterator it)
 {
-	unique_lock<shared_mutex> lock(rwl_send_queue);
+	SenderRequest* sr = *it;
+	pair<multimap<pair<uint32_t, uint32_t>, list<SenderRequest*>::iterator>::iterator,
+	     multimap<pair<uint32_t, uint32_t>, list<SenderRequest*>::iterator>::iterator> range =
+	 upload_index.equal_range(make_pair(sr->getPiece(), sr->getOffset()));
+	for (/* nothing */; range.first != range.second; range.first++) {
+		if (range.first->second != it)
+			continue;
+		upload_index.erase(range.first);
+		break;
+	}
+	return bulk_queue.erase(it);
+}
 
-	list<SenderRequest*>::iterator it = send_queue.begin();
-	while (it != send_queue.end()) {
-		SenderRequest* sr = *it;
-		if (sr->getPiece() != piece || sr->getOffset() != offset ||
-		    sr->getPieceLength() != length || sr->isPartialRequest()) {
-			it++;
+SenderRequest*
+Peer::dequeueUpload()
+{
+	SenderRequest* sr = bulk_queue.front();
+	removeUpload(bulk_queue.begin());
+	return sr;
+}
+
+void
+Peer::fetchSenderRequests()
+{
+	SenderRequest* sr;
+	while ((sr = static_cast<SenderRequest*>(send_inbox.pop())) != NULL) {
+		if (sr->isCancelling()) {
+			/* Drop any upload of this chunk we haven't started yet */
+			pair<multimap<pair<uint32_t, uint32_t>, list<SenderRequest*>::iterator>::iterator,
+			     multimap<pair<uint32_t, uint32_t>, list<SenderRequest*>::iterator>::iterator> range =
+			 upload_index.equal_range(make_pair(sr->getPiece(), sr->getOffset()));
+			while (range.first != range.second) {
+				list<SenderRequest*>::iterator it = (range.first++)->second;
+				SenderRequest* upload = *it;
+				if (upload->getPieceLength() != sr->getPieceLength() || upload->isPartialRequest())
+					continue;
+				removeUpload(it);
+				delete upload;
+			}
+			delete sr;
 			continue;
 		}
 
-		delete sr;
-		it = send_queue.erase(it);
+		if (sr->isDiscardingUploads()) {
+			/* A piece we are in the middle of sending must be finished */
+			list<SenderRequest*>::iterator it = bulk_queue.begin();
+			while (it != bulk_queue.end()) {
+				if ((*it)->isPartialRequest()) {
+					it++;
+					continue;
+				}
+				SenderRequest* upload = *it;
+				it = removeUpload(it);
+				delete upload;
+			}
+		}
+
+		if (sr->haveData())
+			queueUpload(sr, false);
+		else
+			control_queue.push_back(sr);
+	}
+}
+
+void
+Peer::prefetchUploads()
+{
+	/* Only we can touch the queue, so there is no need to collect anything first */
+	unsigned int n = 0;
+	for (list<SenderRequest*>::iterator it = bulk_queue.begin();
+	     it != bulk_queue.end() && n < PEER_UPLOAD_READAHEAD; it++, n++) {
+		SenderRequest* sr = *it;
+		if (sr->isPrefetched())
+			continue;
+		sr->setPrefetched();
+		torrent->prefetchChunk(sr->getPiece(), sr->getOffset(), sr->getPieceLength());
 	}
 }
 
+void
+Peer::cancelChunkRequest(unsigned int piece, unsigned int offset, unsigned int length)
+{
+	/* The sender will drop the upload once it comes across this */
+	SenderRequest* sr = new SenderRequest(torrent, piece, offset, length);
+	sr->setCancelling();
+	queueSenderRequest(sr);
+}
+
 void
 Peer::timer() {
 	{
@@ -790,6 +1021,12 @@ Peer::timer() {
 		rx_bytes = 0; tx_bytes = 0;
 	}
 
+	/* If connecting takes too long, give up */
+	if (areConnecting() && time(NULL) >= launchTime + PEER_CONNECT_TIMEOUT && !terminating) {
+		TRACE(NETWORK, "connect timeout: peer=%s", getID().c_str());
+		shutdown();
+	}
+
 	/* If we are inactive for too long, pull the plug */
 	if (time(NULL) > lastTime + PEER_KICK_SECONDS && !terminating) {
 		TRACE(NETWORK, "kicking peer due to inactivity: peer=%s", getID().c_str());
@@ -827,7 +1064,13 @@ Peer::choke()
 {
 	assert (!peer_choked);
 
-	queueSenderRequest(new SenderRequest(PEER_MSGID_CHOKE, (const uint8_t*)NULL, 0));
+	/*
+	 * The choke overtakes any queued uploads, and the peer will consider its
+	 * requests dropped once it arrives; so have the sender drop them.
+	 */
+	SenderRequest* sr = new SenderRequest(PEER_MSGID_CHOKE, (const uint8_t*)NULL, 0);
+	sr->setDiscardingUploads();
+	queueSenderRequest(sr);
 	TRACE(PROTOCOL, "sent choke: peer=%s", getID().c_str());
 	peer_choked = true;
 }
@@ -868,6 +1111,7 @@ Peer::connectionDone()
 {
 	TRACE(NETWORK, "connection completed: peer=%s", getID().c_str());
 	connection->connectionDone();
+	torrent->callbackPeerConnected(this);
 }
 
 void
@@ -889,28 +1133,32 @@ Peer::getAverageRate(uint32_t* rx, uint32_t* tx)
 	}
 }
 
-void
+bool
 Peer::cancelChunk(uint32_t piece, uint32_t offset, uint32_t len)
 {
-	unique_lock<mutex> lock(mtx_data);
+	{
+		unique_lock<mutex> lock(mtx_data);
+		if (chunk_requests.erase(OutstandingChunkRequest(piece, offset, len)) == 0)
+			return false;
+	}
 
-	/* XXX we assume the list will only contain unique requests */
-	for (list<OutstandingChunkRequest>::iterator it = chunk_requests.begin();
-	     it != chunk_requests.end(); it++) {
-		if (!((*it) == OutstandingChunkRequest(piece, offset, len)))
-			continue;
+	/* This chunk matches! Say goodbye */
+	uint8_t msg[12];
+	WRITE_UINT32(msg, 0, piece);
+	WRITE_UINT32(msg, 4, offset);
+	WRITE_UINT32(msg, 8, len);
+	queueSenderRequest(new SenderRequest(PEER_MSGID_CANCEL, msg, 12));
+	TRACE(TORRENT, "cancelchunk: peer=%s, piece=%u, offset=%u, len=%u, cancelled",
+	 getID().c_str(), piece, offset, len);
+	return true;
+}
 
-		/* This chunk matches! Say goodbye */
-		chunk_requests.erase(it);
-		uint8_t msg[12];
-		WRITE_UINT32(msg, 0, piece);
-		WRITE_UINT32(msg, 4, offset);
-		WRITE_UINT32(msg, 8, len);
-		queueSenderRequest(new SenderRequest(PEER_MSGID_CANCEL, msg, 12));
-		TRACE(TORRENT, "cancelchunk: peer=%s, piece=%u, offset=%u, len=%u, cancelled",
-		 getID().c_str(), piece, offset, len);
-		return;
-	}
+bool
+Peer::isRequestingChunk(uint32_t piece, uint32_t offset)
+{
+	unique_lock<mutex> lock(mtx_data);
+	set<OutstandingChunkRequest>::iterator it = chunk_requests.lower_bound(OutstandingChunkRequest(piece, offset, 0));
+	return it != chunk_requests.end() && it->getPiece() == piece && it->getOffset() == offset;
 }
 
 std::string
@@ -922,12 +1170,7 @@ Peer::getID()
 bool
 Peer::isSenderQueueEmpty()
 {
-	bool b;
-	{
-		shared_lock<shared_mutex> lock(rwl_send_queue);
-		b = send_queue.empty();
-	}
-	return b;
+	return control_queue.empty() && bulk_queue.empty() && send_inbox.empty();
 }
 
 void
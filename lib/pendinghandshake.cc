@@ -0,0 +1,45 @@
+#include <errno.h>
+#include "pendinghandshake.h"
+
+using namespace Tortilla;
+
+PendingHandshake::PendingHandshake(Connection* c, unsigned int timeout)
+{
+	connection = c; received = 0;
+	deadline = time(NULL) + timeout;
+}
+
+PendingHandshake::~PendingHandshake()
+{
+	delete connection;
+}
+
+bool
+PendingHandshake::receive()
+{
+	/*
+	 * Never read beyond the first part; anything after it belongs to the peer,
+	 * which will pick it up once it is created.
+	 */
+	ssize_t len = connection->read((void*)(handshake + received), PENDINGHANDSHAKE_LENGTH - received);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return false;
+	if (len <= 0)
+		return true;
+	received += len;
+
+	/* Validate the protocol string as soon as it is in; no need to wait for the rest */
+	if (handshake[0] != sizeof(PEER_PSTR) - 1)
+		return true;
+	return false;
+}
+
+Connection*
+PendingHandshake::releaseConnection()
+{
+	Connection* c = connection;
+	connection = NULL;
+	return c;
+}
+
+/* vim:set ts=2 sw=2: */
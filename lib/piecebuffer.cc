@@ -0,0 +1,65 @@
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include "piecebuffer.h"
+#include "torrent.h"
+
+using namespace boost;
+using namespace Tortilla;
+
+PieceBuffer::PieceBuffer(uint32_t len)
+{
+	length = len; hashed = 0; hashing = false; pendingComplete = false;
+	data = new uint8_t[len];
+	haveChunk.resize((len + TORRENT_CHUNK_SIZE - 1) / TORRENT_CHUNK_SIZE, false);
+}
+
+PieceBuffer::~PieceBuffer()
+{
+	delete[] data;
+}
+
+void
+PieceBuffer::store(uint32_t offset, const uint8_t* buf, uint32_t len)
+{
+	assert(offset + len <= length);
+	assert(offset % TORRENT_CHUNK_SIZE == 0);
+	memcpy(data + offset, buf, len);
+	haveChunk[offset / TORRENT_CHUNK_SIZE] = true;
+}
+
+bool
+PieceBuffer::claimHasher()
+{
+	if (hashing || hashed == length || !haveChunk[hashed / TORRENT_CHUNK_SIZE])
+		return false;
+	hashing = true;
+	return true;
+}
+
+void
+PieceBuffer::hash(unique_lock<mutex>& lock)
+{
+	assert(hashing);
+
+	/*
+	 * Feed any chunks that directly follow what we have hashed to the hasher;
+	 * chunks that are stored meanwhile are picked up by the next round.
+	 */
+	while (true) {
+		uint32_t end = hashed;
+		while (end < length && haveChunk[end / TORRENT_CHUNK_SIZE])
+			end += std::min((uint32_t)TORRENT_CHUNK_SIZE, length - end);
+		if (end == hashed)
+			break;
+
+		uint32_t start = hashed;
+		lock.unlock();
+		sha1.process(data + start, end - start);
+		lock.lock();
+		hashed = end;
+	}
+	hashing = false;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,162 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "piecepicker.h"
+
+using namespace std;
+using namespace Tortilla;
+
+//! \brief Position of pieces we don't need
+#define PIECEPICKER_NOT_WANTED ((unsigned int)-1)
+
+PiecePicker::PiecePicker(unsigned int num)
+	: numPieces(num), numWanted(0)
+{
+	availability.resize(numPieces, 0);
+	position.resize(numPieces, PIECEPICKER_NOT_WANTED);
+	for (unsigned int i = 0; i < numPieces; i++)
+		setWanted(i, true);
+}
+
+void
+PiecePicker::insertPiece(unsigned int piece)
+{
+	unsigned int n = availability[piece];
+	if (buckets.size() <= n)
+		buckets.resize(n + 1);
+	vector<unsigned int>& bucket = buckets[n];
+
+	/* Swap the piece with a random one, so that every peer picks differently */
+	bucket.push_back(piece);
+	position[piece] = bucket.size() - 1;
+	unsigned int other = bucket[rand() % bucket.size()];
+	std::swap(bucket[position[piece]], bucket[position[other]]);
+	std::swap(position[piece], position[other]);
+}
+
+void
+PiecePicker::removePiece(unsigned int piece)
+{
+	vector<unsigned int>& bucket = buckets[availability[piece]];
+
+	/* Move the final piece in the bucket to our spot; order isn't important */
+	unsigned int last = bucket.back();
+	bucket[position[piece]] = last;
+	position[last] = position[piece];
+	bucket.pop_back();
+	position[piece] = PIECEPICKER_NOT_WANTED;
+}
+
+void
+PiecePicker::addAvailability(unsigned int piece)
+{
+	assert(piece < numPieces);
+
+	bool wanted = isWanted(piece);
+	if (wanted)
+		removePiece(piece);
+	availability[piece]++;
+	if (wanted)
+		insertPiece(piece);
+}
+
+void
+PiecePicker::removeAvailability(unsigned int piece)
+{
+	assert(piece < numPieces);
+	assert(availability[piece] > 0);
+
+	bool wanted = isWanted(piece);
+	if (wanted)
+		removePiece(piece);
+	availability[piece]--;
+	if (wanted)
+		insertPiece(piece);
+}
+
+unsigned int
+PiecePicker::getAvailability(unsigned int piece) const
+{
+	assert(piece < numPieces);
+	return availability[piece];
+}
+
+void
+PiecePicker::setWanted(unsigned int piece, bool wanted)
+{
+	assert(piece < numPieces);
+	if (isWanted(piece) == wanted)
+		return;
+
+	if (wanted) {
+		insertPiece(piece);
+		numWanted++;
+	} else {
+		removePiece(piece);
+		partial.erase(piece);
+		numWanted--;
+	}
+}
+
+bool
+PiecePicker::isWanted(unsigned int piece) const
+{
+	assert(piece < numPieces);
+	return position[piece] != PIECEPICKER_NOT_WANTED;
+}
+
+void
+PiecePicker::setPartial(unsigned int piece, bool partial)
+{
+	assert(piece < numPieces);
+	if (partial && isWanted(piece))
+		this->partial.insert(piece);
+	else
+		this->partial.erase(piece);
+}
+
+void
+PiecePicker::pick(const Bitfield& have, const set<unsigned int>& exclude, vector<unsigned int>& pieces, unsigned int max) const
+{
+	assert(have.size() >= numPieces);
+
+	/* First of all, try to finish what we started */
+	for (set<unsigned int>::const_iterator it = partial.begin();
+	     it != partial.end() && pieces.size() < max; it++) {
+		if (have[*it] && exclude.find(*it) == exclude.end())
+			pieces.push_back(*it);
+	}
+
+	if (numPieces - numWanted < PIECEPICKER_RANDOM_FIRST) {
+		/*
+		 * We have next to nothing; just take whatever the peer has, starting at
+		 * a random piece.
+		 */
+		unsigned int start = (numPieces > 0) ? rand() % numPieces : 0;
+		for (unsigned int i = 0; i < numPieces && pieces.size() < max; i++) {
+			unsigned int piece = (start + i) % numPieces;
+			if (!isWanted(piece) || !have[piece] || partial.find(piece) != partial.end() ||
+			    exclude.find(piece) != exclude.end())
+				continue;
+			pieces.push_back(piece);
+		}
+		return;
+	}
+
+	/*
+	 * Go for the rarest pieces first. As the peer has the pieces we are
+	 * looking for, there is no need to look at pieces nobody has.
+	 */
+	for (unsigned int n = 1; n < buckets.size() && pieces.size() < max; n++) {
+		const vector<unsigned int>& bucket = buckets[n];
+		for (vector<unsigned int>::const_iterator it = bucket.begin();
+		     it != bucket.end() && pieces.size() < max; it++) {
+			unsigned int piece = *it;
+			if (!have[piece] || partial.find(piece) != partial.end() ||
+			    exclude.find(piece) != exclude.end())
+				continue;
+			pieces.push_back(piece);
+		}
+	}
+}
+
+/* vim:set ts=2 sw=2: */
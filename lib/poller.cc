@@ -0,0 +1,185 @@
+#include <boost/thread/locks.hpp>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#include "exceptions.h"
+#include "poller.h"
+
+using namespace std;
+using namespace boost;
+using namespace Tortilla;
+
+#ifdef __linux__
+
+static uint32_t
+toEpoll(unsigned int events)
+{
+	uint32_t e = 0;
+	if (events & POLLER_READ)
+		e |= EPOLLIN;
+	if (events & POLLER_WRITE)
+		e |= EPOLLOUT;
+	if (events & POLLER_EDGE)
+		e |= EPOLLET;
+	return e;
+}
+
+Poller::Poller()
+{
+	epfd = epoll_create(POLLER_MAX_EVENTS /* only a hint */);
+	if (epfd < 0)
+		throw ConnectionException("epoll_create(): " + string(strerror(errno)));
+}
+
+Poller::~Poller()
+{
+	close(epfd);
+}
+
+void
+Poller::add(int fd, unsigned int events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = toEpoll(events);
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno == EEXIST)
+		epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void
+Poller::modify(int fd, unsigned int events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = toEpoll(events);
+	ev.data.fd = fd;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void
+Poller::remove(int fd)
+{
+	/* Pre-2.6.9 kernels insist on a non-NULL event, even though it's unused */
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int
+Poller::wait(vector<PollerEvent>& events, int timeout)
+{
+	struct epoll_event ev[POLLER_MAX_EVENTS];
+
+	events.clear();
+	int n = epoll_wait(epfd, ev, POLLER_MAX_EVENTS, timeout);
+	for (int i = 0; i < n; i++) {
+		unsigned int e = 0;
+		if (ev[i].events & EPOLLIN)
+			e |= POLLER_READ;
+		if (ev[i].events & EPOLLOUT)
+			e |= POLLER_WRITE;
+		if (ev[i].events & (EPOLLERR | EPOLLHUP))
+			e |= POLLER_ERROR;
+		events.push_back(PollerEvent(ev[i].data.fd, e));
+	}
+	return events.size();
+}
+
+#else /* !__linux__ */
+
+Poller::Poller()
+{
+}
+
+Poller::~Poller()
+{
+}
+
+void
+Poller::add(int fd, unsigned int events)
+{
+	unique_lock<mutex> lock(mtx_data);
+	interest[fd] = events;
+}
+
+void
+Poller::modify(int fd, unsigned int events)
+{
+	unique_lock<mutex> lock(mtx_data);
+	map<int, unsigned int>::iterator it = interest.find(fd);
+	if (it != interest.end())
+		it->second = events;
+}
+
+void
+Poller::remove(int fd)
+{
+	unique_lock<mutex> lock(mtx_data);
+	interest.erase(fd);
+}
+
+int
+Poller::wait(vector<PollerEvent>& events, int timeout)
+{
+	/*
+	 * poll(2) wants the entire set every time; build it from the interest map.
+	 * Unlike select(2), this isn't limited by FD_SETSIZE.
+	 */
+	vector<struct pollfd> pfds;
+	{
+		unique_lock<mutex> lock(mtx_data);
+		pfds.reserve(interest.size());
+		for (map<int, unsigned int>::iterator it = interest.begin();
+		     it != interest.end(); it++) {
+			/* Descriptors we aren't interested in won't report errors either */
+			if ((it->second & (POLLER_READ | POLLER_WRITE)) == 0)
+				continue;
+			struct pollfd pfd;
+			pfd.fd = it->first; pfd.revents = 0; pfd.events = 0;
+			if (it->second & POLLER_READ)
+				pfd.events |= POLLIN;
+			if (it->second & POLLER_WRITE)
+				pfd.events |= POLLOUT;
+			pfds.push_back(pfd);
+		}
+	}
+
+	events.clear();
+	if (pfds.empty()) {
+		poll(NULL, 0, timeout);
+		return 0;
+	}
+	if (poll(&pfds[0], pfds.size(), timeout) <= 0)
+		return 0;
+
+	for (vector<struct pollfd>::iterator it = pfds.begin();
+	     it != pfds.end() && events.size() < POLLER_MAX_EVENTS; it++) {
+		unsigned int e = 0;
+		if (it->revents & POLLIN)
+			e |= POLLER_READ;
+		if (it->revents & POLLOUT)
+			e |= POLLER_WRITE;
+		if (it->revents & (POLLERR | POLLHUP | POLLNVAL))
+			e |= POLLER_ERROR;
+		if (e == 0)
+			continue;
+		events.push_back(PollerEvent(it->fd, e));
+
+		/* Edge-triggered descriptors are disarmed until modified again */
+		unique_lock<mutex> lock(mtx_data);
+		map<int, unsigned int>::iterator iit = interest.find(it->fd);
+		if (iit != interest.end() && (iit->second & POLLER_EDGE))
+			iit->second = POLLER_EDGE;
+	}
+	return events.size();
+}
+
+#endif /* __linux__ */
+
+/* vim:set ts=2 sw=2: */
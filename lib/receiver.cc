@@ -3,9 +3,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <list>
+#include <vector>
 #include "exceptions.h"
 #include "httprequest.h"
 #include "peer.h"
+#include "pendinghandshake.h"
 #include "receiver.h"
 #include "macros.h"
 #include "overseer.h"
@@ -24,16 +26,27 @@ receiver_thread(void* ptr)
 	return NULL;
 }
 
-Receiver::Receiver(Overseer* o)
-	: overseer(o), terminating(false),
+Receiver::Receiver(Overseer* o, bool listen)
+	: overseer(o), throttledUntil(0), listening(listen), terminating(false),
 	  thread(receiver_thread, this)
 {
+	/*
+	 * Add the listener socket; it makes absolutely no sense to monitor this
+	 * socket seperately from the rest.
+	 */
+	if (listening)
+		poller.add(overseer->getIncoming()->getFD(), POLLER_READ);
 }
 
 Receiver::~Receiver()
 {
 	terminating = true;
 	thread.join();
+
+	/* Connections that never finished handshaking are ours to close */
+	for (map<int, PendingHandshake*>::iterator it = handshakes.begin();
+	     it != handshakes.end(); it++)
+		delete it->second;
 }
 
 void
@@ -42,6 +55,9 @@ Receiver::addPeer(Peer* p)
 	unique_lock<shared_mutex> lock(rwl_data);
 	peers.push_back(p);
 	fdMap[p->getFD()] = p;
+
+	/* The result of a connect(2)-attempt triggers a write event */
+	poller.add(p->getFD(), POLLER_READ | (p->areConnecting() ? POLLER_WRITE : 0));
 }
 
 void
@@ -49,6 +65,8 @@ Receiver::removePeer(Peer* p)
 {
 	{
 		unique_lock<shared_mutex> lock(rwl_data);
+		poller.remove(p->getFD());
+		overseer->removeSenderPeer(p->getFD());
 		fdMap.erase(p->getFD());
 		peers.remove(p);
 	}
@@ -60,7 +78,10 @@ void
 Receiver::addRequest(HTTPRequest* r)
 {
 	unique_lock<shared_mutex> lock(rwl_data);
-	requests.push_back(r);
+	requests[r->getFD()] = r;
+	poller.add(r->getFD(),
+	 (r->isWaitingForRead() ? POLLER_READ : 0) |
+	 (r->isWaitingForWrite() ? POLLER_WRITE : 0));
 }
 
 void
@@ -68,7 +89,8 @@ Receiver::removeRequest(HTTPRequest* r)
 {
 	{
 		unique_lock<shared_mutex> lock(rwl_data);
-		requests.remove(r);
+		poller.remove(r->getFD());
+		requests.erase(r->getFD());
 	}
 
 	delete r;
@@ -108,9 +130,10 @@ Receiver::removePeerByFD(int fd)
 void
 Receiver::process()
 {
-	while (!terminating) {
-		fd_set readfds, writefds;
+	vector<PollerEvent> events;
+	events.reserve(POLLER_MAX_EVENTS);
 
+	while (!terminating) {
 		/*
 		 * Gracefully handle any peers that are going away
 		 * XXX this is O(|peers|) which we can often skip if no peers are shutting down
@@ -126,72 +149,44 @@ Receiver::process()
 				}
 
 				peerit = peers.erase(peerit);
+				poller.remove(p->getFD());
+				overseer->removeSenderPeer(p->getFD());
 				fdMap.erase(p->getFD());
 				p->getTorrent()->unregisterPeer(p);
 				delete p;
 			}
 
 			/* Remove any requests that need to go, too */
-			list<HTTPRequest*>::iterator reqit = requests.begin();
+			map<int, HTTPRequest*>::iterator reqit = requests.begin();
 			while (reqit != requests.end()) {
-				HTTPRequest* r = *reqit;
+				HTTPRequest* r = reqit->second;
 				if (!r->mustTerminate()) {
 					reqit++;
 					continue;
 				}
-				reqit = requests.erase(reqit);
+				poller.remove(reqit->first);
+				requests.erase(reqit++);
 				delete r;
 			}
 		}
 
 		/*
-		 * Construct our file descriptor set; we need to make read/write sets
-		 * because the result of a connect(2)-attempt triggers a write event.
-		 */
-		int maxfd = -1;
-		FD_ZERO(&readfds); FD_ZERO(&writefds);
-		{
-			shared_lock<shared_mutex> lock(rwl_data);
-			for (list<Peer*>::iterator it = peers.begin();
-					 it != peers.end(); it++) {
-				Peer* p = *it;
-				int fd = p->getFD();
-				if (maxfd < fd) maxfd = fd;
-				if (p->areConnecting())
-					FD_SET(fd, &writefds);
-				FD_SET(fd, &readfds);
-			}
-
-			/* Handle requests, too */
-			for (list<HTTPRequest*>::iterator it = requests.begin();
-					 it != requests.end(); it++) {
-				HTTPRequest* r = *it;
-				int fd = r->getFD();
-				if (maxfd < fd) maxfd = fd;
-				if (r->isWaitingForRead())
-					FD_SET(fd, &readfds);
-				if (r->isWaitingForWrite())
-					FD_SET(fd, &writefds);
-			}
-		}
-
-		/*
-		 * Add the listener socket; it makes absolutely no sense to monitor this
-		 * socket seperately from the rest.
-		 */
-		int listenerFD = overseer->getIncoming()->getFD();
-		FD_SET(listenerFD, &readfds);
-		if (maxfd < listenerFD)
-			maxfd = listenerFD;
-
-		/*
+		 * Wait for something to happen; interest is kept up-to-date as peers and
+		 * requests are added and removed, so there is nothing to construct here.
 		 *
-		 * Note that, for busy torrents, this 0.5 second loop will never be reached.
+		 * Note that, for busy torrents, this timeout will never be reached.
 		 */
-		struct timeval tv;
-		tv.tv_sec = 0; tv.tv_usec = 5000;
-		int n = select(maxfd + 1, &readfds, &writefds, (fd_set*)NULL, &tv);
-		if (n == 0)
+		if (listening)
+			expireHandshakes();
+		int timeout = RECEIVER_POLL_TIMEOUT;
+		if (!throttled.empty()) {
+			uint64_t now = TokenBucket::getTime();
+			if (now >= throttledUntil)
+				resumeThrottled();
+			else
+				timeout = std::min((uint64_t)timeout, (throttledUntil - now + 999) / 1000);
+		}
+		if (poller.wait(events, timeout) == 0)
 			continue;
 
 		/* If we are terminating, we don't care about any data as we're leaving */
@@ -199,74 +194,223 @@ Receiver::process()
 			continue;
 
 		/*
-		 * Wade through all peers, handle any data to service.
+		 * Wade through all events, handle any data to service.
 		 */
+		int listenerFD = listening ? overseer->getIncoming()->getFD() : -1;
+		bool mustAccept = false;
+		vector<PendingHandshake*> handshaken;
 		{
 			shared_lock<shared_mutex> lock(rwl_data);
-			for (list<Peer*>::iterator it = peers.begin();
-					 it != peers.end(); it++) {
-				Peer* p = (*it);
-				int fd = (*it)->getFD();
-				if (FD_ISSET(fd, &writefds)) {
+			for (vector<PollerEvent>::iterator it = events.begin();
+			     it != events.end(); it++) {
+				int fd = it->fd;
+				if (fd == listenerFD) {
+					/* Handled once we let go of the lock */
+					mustAccept = true;
+					continue;
+				}
+
+				map<int, PendingHandshake*>::iterator hsit = handshakes.find(fd);
+				if (hsit != handshakes.end()) {
+					/*
+					 * Completed handshakes are handled once we let go of the lock, as
+					 * the new peer may well end up being added to us.
+					 */
+					if (processHandshake(hsit->second))
+						handshaken.push_back(hsit->second);
+					continue;
+				}
+
+				map<int, HTTPRequest*>::iterator reqit = requests.find(fd);
+				if (reqit != requests.end()) {
+					HTTPRequest* r = reqit->second;
+					r->process();
+					if (r->mustTerminate()) {
+						poller.remove(fd);
+						continue;
+					}
+					poller.modify(fd,
+					 (r->isWaitingForRead() ? POLLER_READ : 0) |
+					 (r->isWaitingForWrite() ? POLLER_WRITE : 0));
+					continue;
+				}
+
+				map<int, Peer*>::iterator peerit = fdMap.find(fd);
+				if (peerit == fdMap.end())
+					continue;
+				Peer* p = peerit->second;
+				if (p->isShuttingDown())
+					continue;
+
+				if (it->events & POLLER_WRITE) {
 					/* Handle with made connections */
-					if (p->areConnecting())
+					if (p->areConnecting()) {
 						p->connectionDone();
+						poller.modify(fd, POLLER_READ);
+					}
 				}
-				if (!FD_ISSET(fd, &readfds))
+				if (!(it->events & (POLLER_READ | POLLER_ERROR)))
 					continue;
 
 				/*
-				 * There is data here.
+				 * If we may not download anything right now, stop reading from the
+				 * peer until we may again; errors are always read, so that we notice
+				 * the connection going away.
+				 */
+				uint64_t delay = 0;
+				ssize_t allowance = getDownloadAllowance(p, delay);
+				if (allowance == 0 && !(it->events & POLLER_ERROR)) {
+					uint64_t until = TokenBucket::getTime() + delay;
+					if (throttled.empty() || until < throttledUntil)
+						throttledUntil = until;
+					throttled.push_back(fd);
+					poller.modify(fd, 0);
+					continue;
+				}
+
+				/*
+				 * There is data here; read it directly into the peer's buffer.
 				 */
-				uint8_t buf[65536 /* XXX */];
-				ssize_t len = ::recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+				struct iovec iov[2];
+				int iovcnt = p->getReceiveBuffers(iov);
+				if (iovcnt == 0) {
+					TRACE(NETWORK, "out of space to store data received from peer=%s, closing connection", p->getID().c_str());
+					p->shutdown();
+					poller.remove(fd);
+					continue;
+				}
+				if (allowance > 0) {
+					size_t left = allowance;
+					for (int i = 0; i < iovcnt; i++) {
+						iov[i].iov_len = std::min(iov[i].iov_len, left);
+						left -= iov[i].iov_len;
+					}
+				}
+				ssize_t len = ::readv(fd, iov, iovcnt);
+				if (len < 0 && (errno == EAGAIN || errno == EINTR))
+					continue;
 				if (len <= 0) {
 					/* socket lost */
 					TRACE(TORRENT, "connection to peer=%s lost, socket closed, errno=%u, len=%ld", p->getID().c_str(), errno, len);
 					p->shutdown();
+					poller.remove(fd);
 					continue;
 				}
 
+				overseer->download_bucket.consume(len);
+				p->getTorrent()->download_bucket.consume(len);
+
 				/* Hand the data off to the application */
-				if (p->receive(buf, len) == true) {
+				if (p->receive(len) == true) {
 					/* Need to sever the connection */
 					TRACE(TORRENT, "severing connection to peer=%s", p->getID().c_str());
 					p->shutdown();
+					poller.remove(fd);
 					continue;
 				}
 			}
+		}
 
-			for (list<HTTPRequest*>::iterator it = requests.begin();
-					 it != requests.end(); it++) {
-				HTTPRequest* r = *it;
-				int fd = r->getFD();
-
-				if (FD_ISSET(fd, &readfds) || FD_ISSET(fd, &writefds))
-					r->process();
-			}
+		/* Hand connections that completed their handshake off to the overseer */
+		for (vector<PendingHandshake*>::iterator it = handshaken.begin();
+		     it != handshaken.end(); it++) {
+			PendingHandshake* ph = *it;
+			overseer->handleIncomingConnection(ph->releaseConnection(), ph->getHandshake());
+			delete ph;
 		}
 
 		/* If we need to accept new connections, handle that */
-		if (FD_ISSET(listenerFD, &readfds) && !terminating) {
-			Connection* c = overseer->getIncoming()->acceptConnection();
-			if (c != NULL) {
-				overseer->handleIncomingConnection(c);
-			}
+		if (mustAccept && !terminating)
+			acceptConnections();
+	}
+}
+
+void
+Receiver::acceptConnections()
+{
+	Connection* c;
+	while ((c = overseer->getIncoming()->acceptConnection()) != NULL) {
+		if (handshakes.size() >= RECEIVER_MAX_PENDING_HANDSHAKES) {
+			TRACE(NETWORK, "too many pending handshakes, dropping connection from %s", c->getEndpoint().c_str());
+			delete c;
+			continue;
+		}
+
+		/*
+		 * Wait for the handshake to arrive; we'll pick it up in the main loop, as
+		 * to not wait for anyone in particular.
+		 */
+		int fd = c->getFD();
+		handshakes[fd] = new PendingHandshake(c, RECEIVER_HANDSHAKE_TIMEOUT);
+		poller.add(fd, POLLER_READ);
+	}
+}
+
+bool
+Receiver::processHandshake(PendingHandshake* ph)
+{
+	int fd = ph->getConnection()->getFD();
+	if (ph->receive()) {
+		TRACE(NETWORK, "bad or no handshake from %s, dropping", ph->getConnection()->getEndpoint().c_str());
+		poller.remove(fd);
+		handshakes.erase(fd);
+		delete ph;
+		return false;
+	}
+	if (!ph->isComplete())
+		return false;
+
+	TRACE(NETWORK, "got handshake (part 1): connection=%s", ph->getConnection()->getEndpoint().c_str());
+	poller.remove(fd);
+	handshakes.erase(fd);
+	return true;
+}
+
+void
+Receiver::expireHandshakes()
+{
+	time_t now = time(NULL);
+	map<int, PendingHandshake*>::iterator it = handshakes.begin();
+	while (it != handshakes.end()) {
+		PendingHandshake* ph = it->second;
+		if (!ph->isExpired(now)) {
+			it++;
+			continue;
 		}
+
+		/* No data! So sad... */
+		TRACE(NETWORK, "timeout waiting for handshake from %s", ph->getConnection()->getEndpoint().c_str());
+		poller.remove(it->first);
+		handshakes.erase(it++);
+		delete ph;
 	}
 }
 
+ssize_t
+Receiver::getDownloadAllowance(Peer* p, uint64_t& delay)
+{
+	uint64_t global_delay = 0, torrent_delay = 0;
+	ssize_t global_allowance = overseer->download_bucket.getAvailable(global_delay);
+	ssize_t torrent_allowance = p->getTorrent()->download_bucket.getAvailable(torrent_delay);
+	ssize_t allowance = TokenBucket::limit(global_allowance, torrent_allowance);
+	if (allowance == 0)
+		delay = std::max(global_delay, torrent_delay);
+	return allowance;
+}
+
 void
-Receiver::getSendablePeers(list<int>& m) const
+Receiver::resumeThrottled()
 {
 	shared_lock<shared_mutex> lock(rwl_data);
-	for (list<Peer*>::const_iterator it = peers.begin();
-	     it != peers.end(); it++) {
-		Peer* p = *it;
-		if (p->isSenderQueueEmpty())
+	for (vector<int>::iterator it = throttled.begin();
+	     it != throttled.end(); it++) {
+		/* Peers may have gone away in the meantime */
+		map<int, Peer*>::iterator peerit = fdMap.find(*it);
+		if (peerit == fdMap.end() || peerit->second->isShuttingDown())
 			continue;
-		m.push_back(p->getFD());
+		poller.modify(*it, POLLER_READ);
 	}
+	throttled.clear();
 }
 
 /* vim:set ts=2 sw=2: */
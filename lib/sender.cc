@@ -1,8 +1,11 @@
 #include <boost/thread/locks.hpp>
 #include <assert.h>
-#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "exceptions.h"
 #include "macros.h"
 #include "overseer.h"
 #include "sender.h"
@@ -26,9 +29,18 @@ namespace Tortilla {
 }
 
 Sender::Sender(Overseer* o)
-	: terminating(false), overseer(o),
-	  thread(sender_thread, this)
+	: terminating(false), wakeup_pending(false),
+	  quantum(SENDER_DEFAULT_QUANTUM), last_fd(-1), overseer(o)
 {
+	if (pipe(wakeup_pipe) < 0)
+		throw ConnectionException("pipe(): " + string(strerror(errno)));
+	for (int i = 0; i < 2; i++) {
+		int fl = fcntl(wakeup_pipe[i], F_GETFL, NULL);
+		fcntl(wakeup_pipe[i], F_SETFL, fl | O_NONBLOCK);
+	}
+	poller.add(wakeup_pipe[0], POLLER_READ);
+
+	thread = new boost::thread(sender_thread, this);
 }
 
 Sender::~Sender()
@@ -37,99 +49,116 @@ Sender::~Sender()
 	 * Request termination and wait for the thread to die.
 	*/
 	terminating = true;
-	cv.notify_one();
-	thread.join();
+	wakeup();
+	thread->join();
+	delete thread;
+
+	poller.remove(wakeup_pipe[0]);
+	close(wakeup_pipe[0]); close(wakeup_pipe[1]);
 }
 
 void
 Sender::process()
 {
-	unsigned int pfds_max = TORRENT_MAX_PEERS;
-	struct pollfd* pfds = (struct pollfd*)malloc(sizeof(struct pollfd) * pfds_max);
-	assert(pfds != NULL); /* crude */
+	vector<PollerEvent> events;
+	events.reserve(POLLER_MAX_EVENTS);
+	int timeout = -1;
 
 	while(!terminating) {
-		/* Figure out to which peers we must send */
-		list<int> fdMap;
-		fdMap.clear();
-		overseer->getSendablePeers(fdMap);
-		if (fdMap.size() > pfds_max) {
-			pfds = (struct pollfd*)realloc(pfds, sizeof(struct pollfd) * fdMap.size());
-			assert(pfds != NULL); /* crude */
-			pfds_max = fdMap.size();
-		}
-
 		/*
-		 * Wait until we can write to any of these peers. We use poll(2) to query
-		 * this, as it gives us the means to distinguish between a socket closing
-		 * and a socket that actually is ready (closed sockets indicate the peer
-		 * was deleted, so we shouldn't try to send to them.
+		 * Wait until something changes; either a peer has queued something, or
+		 * a socket that couldn't be written to now can. If we have peers to
+		 * serve, we only pick up what happened and continue.
 		 */
-		unsigned int cur_pfd = 0;
-		for (list<int>::iterator it = fdMap.begin();
-		     it != fdMap.end(); it++) {
-			pfds[cur_pfd].fd = *it;
-			pfds[cur_pfd].events = POLLOUT;
-			pfds[cur_pfd].revents = 0;
-			cur_pfd++;
+		poller.wait(events, timeout);
+		if (terminating)
+			break;
+
+		vector<int> deadFDs;
+		{
+			unique_lock<mutex> lock(mtx_data);
+			for (vector<PollerEvent>::iterator it = events.begin();
+			     it != events.end(); it++) {
+				int fd = it->fd;
+				if (fd == wakeup_pipe[0]) {
+					char buf[64];
+					while (read(fd, buf, sizeof(buf)) > 0)
+						/* nothing */ ;
+					wakeup_pending = false;
+					continue;
+				}
+				if (it->events & POLLER_ERROR) {
+					/*
+					 * The socket is gone; this means we have to disconnect the
+					 * peer. The receiver should find this condition as well,
+					 * but since we already are aware of the dead peer, just
+					 * remove it and be done with it.
+					 */
+					pending.erase(fd);
+					deadFDs.push_back(fd);
+					continue;
+				}
+				if (it->events & POLLER_WRITE)
+					blocked.erase(fd);
+			}
 		}
+		for (vector<int>::iterator it = deadFDs.begin(); it != deadFDs.end(); it++)
+			overseer->removePeerByFD(*it);
 
-		/* If there is nothing to wait for, rest and try again */
-		if (cur_pfd == 0) {
+		/* Figure out to which peers we can send */
+		vector<int> peerFDs;
+		{
 			unique_lock<mutex> lock(mtx_data);
-			cv.wait(lock);
-			continue;
+			for (set<int>::iterator it = pending.begin(); it != pending.end(); it++) {
+				if (peers.find(*it) == peers.end() || blocked.find(*it) != blocked.end())
+					continue;
+				peerFDs.push_back(*it);
+			}
 		}
 
-		if (poll(pfds, cur_pfd, 5000) <= 0)
+		/* If there is nothing to do, rest until there is */
+		if (peerFDs.empty()) {
+			timeout = -1;
 			continue;
+		}
 
 		/*
-		 * At least a single peer can be sent to; construct a list of peers
-		 * we can send to, and randomize it. This prevents us from using all
-		 * available bandwidth on the first peer in the list.
+		 * Serve the peers in round robin order, continuing after the last peer
+		 * that got its turn. Every peer only keeps the deficit it had if it is
+		 * still waiting to send; peers that went idle start over.
 		 */
-		vector<unsigned int>peerFDs;
-		for (unsigned int pfd = 0; pfd < cur_pfd; pfd++) {
-			if ((pfds[pfd].revents & POLLHUP) ||
-			    (pfds[pfd].revents & POLLERR)) {
-				/*
-				 * The socket is gone; this means we have to disconnect the
-				 * peer. The receiver should find this condition as well,
-				 * but since we already are aware of the dead peer, just
-				 * remove it and be done with it.
-				 *
-				 * Note that Linux seems to report both POLLERR and POLLHUP
-				 * in a single go, so we just check for either of them - if
-			 	 * the polling failed, the socket is of no futher interest
-				 * and should go anyway...
-				 */
-				overseer->removePeerByFD(pfds[pfd].fd);
-				continue;
-			}
-			if (!(pfds[pfd].revents & POLLOUT))
-				continue;
-
-			peerFDs.push_back(pfds[pfd].fd);
+		rotate(peerFDs.begin(), upper_bound(peerFDs.begin(), peerFDs.end(), last_fd), peerFDs.end());
+		map<int, size_t> cur_deficits;
+		for (vector<int>::iterator it = peerFDs.begin();
+		    it != peerFDs.end(); it++) {
+			map<int, size_t>::iterator dit = deficits.find(*it);
+			cur_deficits[*it] = (dit != deficits.end()) ? dit->second : 0;
+		}
+		deficits.swap(cur_deficits);
+		size_t cur_quantum;
+		{
+			unique_lock<mutex> lock(mtx_data);
+			cur_quantum = quantum;
 		}
-		random_shuffle(peerFDs.begin(), peerFDs.end());
 
-		/* Ask each peer to request */
-		for (vector<unsigned int>::iterator it = peerFDs.begin();
+		/*
+		 * Ask each peer to send its quantum, as far as its upload limits allow.
+		 * If nothing could be sent because of these limits, we'll wait until the
+		 * first of them allows us to send again.
+		 */
+		bool sent = false;
+		uint64_t delay = 0;
+		for (vector<int>::iterator it = peerFDs.begin();
 		    it != peerFDs.end(); it++) {
-			unsigned int fd = *it;
+			int fd = *it;
 
-			/*
-			 * Update amount of bandwidth left; if this is zero, we stop as we can't
-			 * send anymore.
-			 */
-			uint32_t cur_tx;
-			{
-				unique_lock<mutex> lock(mtx_data);
-				cur_tx = tx_left;
-			}
-			if (overseer->getUploadRate() > 0 && cur_tx == 0)
+			/* If we have run out of global bandwidth, we can't send anymore */
+			uint64_t global_delay = 0;
+			ssize_t allowance = overseer->upload_bucket.getAvailable(global_delay);
+			if (allowance == 0) {
+				sent = false; delay = global_delay;
 				break;
+			}
 
 			/*
 			 * Ask the peer to process and update bandwidth use; if we find a peer,
@@ -137,44 +166,132 @@ Sender::process()
 	 		 * processSenderQueue() releases this lock, so we cannot touch 'p' anymore
 		 	 * after it finished!
 			 */
+			{
+				unique_lock<mutex> lock(mtx_data);
+				pending.erase(fd);
+			}
 			Peer* p = overseer->findPeerByFDAndLock(fd);
-			if (p != NULL) {
-				ssize_t amount = p->processSenderQueue(overseer->getUploadRate() > 0 ? cur_tx : -1);
-
-				{
-					unique_lock<mutex> lock(mtx_data);
-					if (tx_left > 0 && amount > 0)
-						tx_left -= amount;
-					cur_tx = tx_left;
+			if (p == NULL)
+				continue;
+
+			uint64_t peer_delay = 0;
+			allowance = TokenBucket::limit(allowance, p->getUploadAllowance(peer_delay));
+			if (allowance == 0 && (delay == 0 || peer_delay < delay))
+				delay = peer_delay;
+
+			/*
+			 * A peer that can't send due to its own limits doesn't earn a quantum;
+			 * others never carry more than a single quantum over to the next round.
+			 */
+			size_t& deficit = deficits[fd];
+			if (allowance != 0) {
+				deficit = std::min(deficit + cur_quantum, 2 * cur_quantum);
+				allowance = TokenBucket::limit(allowance, deficit);
+			}
+
+			/* Note that an allowance of zero merely releases the send lock */
+			bool would_block = false, drained = false;
+			size_t amount = p->processSenderQueue(allowance, would_block, drained);
+			overseer->upload_bucket.consume(amount);
+			if (amount > 0)
+				sent = true;
+			last_fd = fd;
+
+			/*
+			 * We only see this peer again if it has anything left. If the socket is
+			 * full, we must wait until it can be written to again; rearming makes
+			 * sure we don't miss it if that happened in the meantime.
+			 */
+			if (!drained || would_block) {
+				unique_lock<mutex> lock(mtx_data);
+				if (!drained)
+					pending.insert(fd);
+				if (would_block && peers.find(fd) != peers.end()) {
+					blocked.insert(fd);
+					poller.modify(fd, POLLER_WRITE | POLLER_EDGE);
 				}
 			}
-		}
 
-		if (overseer->getUploadRate() > 0 && tx_left == 0) {
 			/*
-		 	 * We've run out of bandwidth to use! Wait for a second for it to
-			 * replenish.
-		 	 */
-			struct timeval tv;
-			tv.tv_sec = 1; tv.tv_usec = 0;
-			select(0, NULL, NULL, NULL, &tv);
+			 * If the peer didn't use its entire allowance, it ran out of things to
+			 * send or was held back by the socket; either way, it is no longer
+			 * owed anything.
+			 */
+			if (allowance != 0) {
+				if (amount == (size_t)allowance)
+					deficit -= amount;
+				else
+					deficit = 0;
+			}
 		}
+
+		/*
+		 * If we've run out of bandwidth to use, wait for it to replenish unless
+		 * we are kicked before that. Otherwise, just pick up any events and
+		 * continue with the next round.
+		 */
+		if (!sent && delay > 0)
+			timeout = (delay + 999) / 1000;
+		else
+			timeout = 0;
+	}
+}
+
+void
+Sender::setQuantum(size_t q)
+{
+	unique_lock<mutex> lock(mtx_data);
+	quantum = q;
+}
+
+size_t
+Sender::getQuantum()
+{
+	unique_lock<mutex> lock(mtx_data);
+	return quantum;
+}
+
+void
+Sender::signal(int fd)
+{
+	{
+		unique_lock<mutex> lock(mtx_data);
+		if (!pending.insert(fd).second)
+			return;
 	}
+	wakeup();
+}
 
-	free(pfds);
+void
+Sender::addPeer(int fd)
+{
+	unique_lock<mutex> lock(mtx_data);
+	peers.insert(fd);
+	blocked.insert(fd);
+	poller.add(fd, POLLER_WRITE | POLLER_EDGE);
 }
 
 void
-Sender::setAmountTransferrable(uint32_t amount)
+Sender::removePeer(int fd)
 {
 	unique_lock<mutex> lock(mtx_data);
-	tx_left = amount;
+	poller.remove(fd);
+	peers.erase(fd);
+	pending.erase(fd);
+	blocked.erase(fd);
 }
 
 void
-Sender::signal()
+Sender::wakeup()
 {
-	cv.notify_one();
+	{
+		unique_lock<mutex> lock(mtx_data);
+		if (wakeup_pending)
+			return;
+		wakeup_pending = true;
+	}
+	char ch = 0;
+	write(wakeup_pipe[1], &ch, 1);
 }
 
 /* vim:set ts=2 sw=2: */
@@ -11,21 +11,26 @@ using namespace Tortilla;
 void
 SenderRequest::__init(uint32_t len)
 {
-	length = len; skip_num = 0; piece = 0; offset = 0; piece_length = 0;
+	length = len; message_length = len; skip_num = 0; piece = 0; offset = 0; piece_length = 0;
+	prefetched = false; cancelling = false; discarding_uploads = false;
 
 	message = new uint8_t[length];
 }
 
 SenderRequest::SenderRequest(Torrent* t, uint32_t piece, uint32_t begin, uint32_t len)
 {
-	__init(len + 13);
+	/*
+	 * Only the header is kept in memory; the payload is sent straight from
+	 * the files once it's our turn.
+	 */
+	__init(13);
+	length += len;
 	this->piece = piece; this->offset = begin; this->piece_length = len;
 
 	WRITE_UINT32(message, 0, len + 9);
 	message[4] = PEER_MSGID_PIECE;
 	WRITE_UINT32(message, 5, piece);
 	WRITE_UINT32(message, 9, offset);
-	t->readChunk(piece, begin, (message + 13), len);
 }
 
 SenderRequest::SenderRequest(uint8_t msg, const uint8_t* data, uint32_t len)
@@ -55,6 +60,16 @@ SenderRequest::getMessageLength() const {
 	return length - skip_num;
 }
 
+const uint32_t
+SenderRequest::getMemoryLength() const {
+	return (skip_num < message_length) ? message_length - skip_num : 0;
+}
+
+const uint32_t
+SenderRequest::getUploadOffset() const {
+	return offset + ((skip_num > message_length) ? skip_num - message_length : 0);
+}
+
 
 SenderRequest::~SenderRequest()
 {
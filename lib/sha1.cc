@@ -21,13 +21,85 @@
  * It has been incorperated in the HashSHA1 class.
  */
 #include <assert.h>
+#include <algorithm>
 #include <iostream>
 #include <stdint.h>
+#include <string.h>
+#include "cpufeatures.h"
 #include "sha1.h"
+#include "sha1impl.h"
 
 using namespace std;
 using namespace Tortilla;
 
+#ifdef SHA1_HAVE_X86
+static bool
+sha1_shani_supported()
+{
+	/* The SHA-NI code uses SSSE3 and SSE4.1 for loading and storing */
+	return CPUFeatures::hasSHA() && CPUFeatures::hasSSSE3() && CPUFeatures::hasSSE41();
+}
+
+static bool
+sha1_avx2_supported()
+{
+	/* The rounds are compiled to use BMI as well, for its rotates */
+	return CPUFeatures::hasAVX2() && CPUFeatures::hasBMI();
+}
+#endif
+
+/*! \brief Available block implementations, best first
+ *
+ *  The first one supported by the CPU is used by default; the portable
+ *  implementation always works.
+ */
+static const struct {
+	const char* name;
+	SHA1BlockFunction func;
+	bool (*supported)();
+} sha1_implementations[] = {
+#ifdef SHA1_HAVE_X86
+	{ "shani", sha1_blocks_shani, sha1_shani_supported },
+	{ "avx2", sha1_blocks_avx2, sha1_avx2_supported },
+	{ "ssse3", sha1_blocks_ssse3, CPUFeatures::hasSSSE3 },
+#endif
+	{ "generic", sha1_blocks_generic, NULL },
+	{ NULL, NULL, NULL }
+};
+
+static int
+sha1_find_implementation(const char* name)
+{
+	for (int i = 0; sha1_implementations[i].name != NULL; i++) {
+		if (name != NULL && strcmp(sha1_implementations[i].name, name) != 0)
+			continue;
+		if (sha1_implementations[i].supported == NULL ||
+		    sha1_implementations[i].supported())
+			return i;
+		if (name != NULL)
+			break;
+	}
+	return -1;
+}
+
+int HashSHA1::implementation = sha1_find_implementation(NULL);
+
+bool
+HashSHA1::setImplementation(const char* name)
+{
+	int i = sha1_find_implementation(name);
+	if (i < 0)
+		return false;
+	implementation = i;
+	return true;
+}
+
+const char*
+HashSHA1::getImplementation()
+{
+	return sha1_implementations[implementation].name;
+}
+
 HashSHA1::HashSHA1()
 	: computed(false), Length_Low(0), Length_High(0), Message_Block_Index(0)
 {
@@ -43,21 +115,28 @@ HashSHA1::process(const void* buf, size_t size)
 {
 	assert(!computed);
 
+	uint64_t length = (((uint64_t)Length_High << 32) | Length_Low) + (uint64_t)size * 8;
+	assert(length >= (((uint64_t)Length_High << 32) | Length_Low)); // Message is too long
+	Length_Low = length & 0xffffffff;
+	Length_High = length >> 32;
+
 	const uint8_t* input = (const uint8_t*)buf;
-	while(size--) {
-		Message_Block[Message_Block_Index++] = (*input & 0xff);
-
-		Length_Low += 8;
-		Length_Low &= 0xffffffff;             // Force it to 32 bits
-		if (Length_Low == 0) {
-			Length_High++;
-			Length_High &= 0xffffffff;          // Force it to 32 bits
-			assert(Length_High != 0);           // Message is too long
+	SHA1BlockFunction func = sha1_implementations[implementation].func;
+	while (size > 0) {
+		/* Whole blocks are processed straight from the input */
+		if (Message_Block_Index == 0 && size >= 64) {
+			size_t numBlocks = size / 64;
+			func(H, input, numBlocks);
+			input += numBlocks * 64; size -= numBlocks * 64;
+			continue;
 		}
 
+		/* Anything else is gathered until we have a block */
+		size_t len = std::min(size, (size_t)(64 - Message_Block_Index));
+		memcpy(Message_Block + Message_Block_Index, input, len);
+		Message_Block_Index += len; input += len; size -= len;
 		if (Message_Block_Index == 64)
 			ProcessMessageBlock();
-		input++;
 	}
 }
 
@@ -79,101 +158,103 @@ HashSHA1::getHash()
 	return hash;
 }
 
-uint32_t
-HashSHA1::CircularShift(int bits, uint32_t word)
+void
+HashSHA1::ProcessMessageBlock()
 {
-	return ((word << bits) & 0xFFFFFFFF) | ((word & 0xFFFFFFFF) >> (32-bits));
+	sha1_implementations[implementation].func(H, Message_Block, 1);
+	Message_Block_Index = 0;
 }
 
 void
-HashSHA1::ProcessMessageBlock()
+Tortilla::sha1_blocks_generic(uint32_t* H, const uint8_t* data, size_t numBlocks)
 {
-	// Constants defined for SHA-1
-	static const uint32_t K[] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
-	uint32_t W[80]; // Word sequence
-
-	//  Initialize the first 16 words in the array W
-	for(int t = 0; t < 16; t++) {
-		W[t] = ((unsigned) Message_Block[t * 4]) << 24;
-		W[t] |= ((unsigned) Message_Block[t * 4 + 1]) << 16;
-		W[t] |= ((unsigned) Message_Block[t * 4 + 2]) << 8;
-		W[t] |= ((unsigned) Message_Block[t * 4 + 3]);
-	}
+	for (/* nothing */; numBlocks > 0; numBlocks--, data += 64) {
+		// Constants defined for SHA-1
+		static const uint32_t K[] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+		uint32_t W[80]; // Word sequence
+
+		//  Initialize the first 16 words in the array W
+		for(int t = 0; t < 16; t++) {
+			W[t] = ((unsigned) data[t * 4]) << 24;
+			W[t] |= ((unsigned) data[t * 4 + 1]) << 16;
+			W[t] |= ((unsigned) data[t * 4 + 2]) << 8;
+			W[t] |= ((unsigned) data[t * 4 + 3]);
+		}
 
 #define ROTATE(bits, word) \
-	(((word) << (bits)) | (((word) >> (32-(bits)))))
+		(((word) << (bits)) | (((word) >> (32-(bits)))))
 
 #define S1(t) \
-		W[t] = ROTATE(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16])
+			W[t] = ROTATE(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16])
 
-	S1(16); S1(17); S1(18); S1(19); S1(20); S1(21); S1(22); S1(23); S1(24);
-	S1(25); S1(26); S1(27); S1(28); S1(29); S1(30); S1(31); S1(32); S1(33);
-	S1(34); S1(35); S1(36); S1(37); S1(38); S1(39); S1(40); S1(41); S1(42);
-	S1(43); S1(44); S1(45); S1(46); S1(47); S1(48); S1(49); S1(50); S1(51);
-	S1(52); S1(53); S1(54); S1(55); S1(56); S1(57); S1(58); S1(59); S1(60);
-	S1(61); S1(62); S1(63); S1(64); S1(65); S1(66); S1(67); S1(68); S1(69);
-	S1(70); S1(71); S1(72); S1(73); S1(74); S1(75); S1(76); S1(77); S1(78);
-	S1(79);
+		S1(16); S1(17); S1(18); S1(19); S1(20); S1(21); S1(22); S1(23); S1(24);
+		S1(25); S1(26); S1(27); S1(28); S1(29); S1(30); S1(31); S1(32); S1(33);
+		S1(34); S1(35); S1(36); S1(37); S1(38); S1(39); S1(40); S1(41); S1(42);
+		S1(43); S1(44); S1(45); S1(46); S1(47); S1(48); S1(49); S1(50); S1(51);
+		S1(52); S1(53); S1(54); S1(55); S1(56); S1(57); S1(58); S1(59); S1(60);
+		S1(61); S1(62); S1(63); S1(64); S1(65); S1(66); S1(67); S1(68); S1(69);
+		S1(70); S1(71); S1(72); S1(73); S1(74); S1(75); S1(76); S1(77); S1(78);
+		S1(79);
 
-	register uint32_t A = H[0];
-	register uint32_t B = H[1];
-	register uint32_t C = H[2];
-	register uint32_t D = H[3];
-	register uint32_t E = H[4];
+		register uint32_t A = H[0];
+		register uint32_t B = H[1];
+		register uint32_t C = H[2];
+		register uint32_t D = H[3];
+		register uint32_t E = H[4];
 
-	register uint32_t temp;
+		register uint32_t temp;
 
 #define S2(t) \
-		temp = ROTATE(5,A) + ((B & C) | ((~B) & D)) + E + W[t] + K[0]; \
-		E = D; \
-		D = C; \
-		C = ROTATE(30,B); \
-		B = A; \
-		A = temp;
+			temp = ROTATE(5,A) + ((B & C) | ((~B) & D)) + E + W[t] + K[0]; \
+			E = D; \
+			D = C; \
+			C = ROTATE(30,B); \
+			B = A; \
+			A = temp;
 
-	S2( 0); S2( 1); S2( 2); S2( 3); S2( 4); S2( 5); S2( 6); S2( 7); S2( 8); S2( 9);
-	S2(10); S2(11); S2(12); S2(13); S2(14); S2(15); S2(16); S2(17); S2(18); S2(19);
+		S2( 0); S2( 1); S2( 2); S2( 3); S2( 4); S2( 5); S2( 6); S2( 7); S2( 8); S2( 9);
+		S2(10); S2(11); S2(12); S2(13); S2(14); S2(15); S2(16); S2(17); S2(18); S2(19);
 
 #define S3(t) \
-		temp = ROTATE(5,A) + (B ^ C ^ D) + E + W[t] + K[1]; \
-		E = D; \
-		D = C; \
-		C = ROTATE(30,B); \
-		B = A; \
-		A = temp;
+			temp = ROTATE(5,A) + (B ^ C ^ D) + E + W[t] + K[1]; \
+			E = D; \
+			D = C; \
+			C = ROTATE(30,B); \
+			B = A; \
+			A = temp;
 
-	S3(20); S3(21); S3(22); S3(23); S3(24); S3(25); S3(26); S3(27); S3(28); S3(29);
-	S3(30); S3(31); S3(32); S3(33); S3(34); S3(35); S3(36); S3(37); S3(38); S3(39);
+		S3(20); S3(21); S3(22); S3(23); S3(24); S3(25); S3(26); S3(27); S3(28); S3(29);
+		S3(30); S3(31); S3(32); S3(33); S3(34); S3(35); S3(36); S3(37); S3(38); S3(39);
 
 #define S4(t) \
-		temp = ROTATE(5,A) + ((B & C) | (B & D) | (C & D)) + E + W[t] + K[2]; \
-		E = D; \
-		D = C; \
-		C = ROTATE(30,B); \
-		B = A; \
-		A = temp;
+			temp = ROTATE(5,A) + ((B & C) | (B & D) | (C & D)) + E + W[t] + K[2]; \
+			E = D; \
+			D = C; \
+			C = ROTATE(30,B); \
+			B = A; \
+			A = temp;
 
-	S4(40); S4(41); S4(42); S4(43); S4(44); S4(45); S4(46); S4(47); S4(48); S4(49);
-	S4(50); S4(51); S4(52); S4(53); S4(54); S4(55); S4(56); S4(57); S4(58); S4(59);
+		S4(40); S4(41); S4(42); S4(43); S4(44); S4(45); S4(46); S4(47); S4(48); S4(49);
+		S4(50); S4(51); S4(52); S4(53); S4(54); S4(55); S4(56); S4(57); S4(58); S4(59);
 
 #define S5(t) \
-		temp = ROTATE(5,A) + (B ^ C ^ D) + E + W[t] + K[3]; \
-		E = D; \
-		D = C; \
-		C = ROTATE(30,B); \
-		B = A; \
-		A = temp;
-
-	S5(60); S5(61); S5(62); S5(63); S5(64); S5(65); S5(66); S5(67); S5(68); S5(69);
-	S5(70); S5(71); S5(72); S5(73); S5(74); S5(75); S5(76); S5(77); S5(78); S5(79);
-
-	H[0] += A;
-	H[1] += B;
-	H[2] += C;
-	H[3] += D;
-	H[4] += E;
+			temp = ROTATE(5,A) + (B ^ C ^ D) + E + W[t] + K[3]; \
+			E = D; \
+			D = C; \
+			C = ROTATE(30,B); \
+			B = A; \
+			A = temp;
+
+		S5(60); S5(61); S5(62); S5(63); S5(64); S5(65); S5(66); S5(67); S5(68); S5(69);
+		S5(70); S5(71); S5(72); S5(73); S5(74); S5(75); S5(76); S5(77); S5(78); S5(79);
+
+		H[0] += A;
+		H[1] += B;
+		H[2] += C;
+		H[3] += D;
+		H[4] += E;
 
-	Message_Block_Index = 0;
+	}
 }
 
 void
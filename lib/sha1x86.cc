@@ -0,0 +1,236 @@
+#include "sha1impl.h"
+
+#ifdef SHA1_HAVE_X86
+#include <immintrin.h>
+
+using namespace Tortilla;
+
+/*
+ * All SIMD code here is compiled for the instruction set named in its
+ * target attribute only; the caller must ensure the CPU supports it.
+ */
+#define SHA1_TARGET(x) __attribute__((target(x)))
+
+#define ROTATE(bits, word) \
+	(((word) << (bits)) | (((word) >> (32-(bits)))))
+
+//! \brief Shuffle mask turning four big-endian words into native ones
+#define SHA1_BSWAP_MASK \
+	_mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3)
+
+//! \brief Round constant for word t, in every position
+#define SHA1_K(t) \
+	((t) < 20 ? 0x5A827999 : (t) < 40 ? 0x6ED9EBA1 : (t) < 60 ? 0x8F1BBCDC : 0xCA62C1D6)
+
+/*
+ * Computes the next four schedule words W[t..t+3] from the previous sixteen,
+ * held in w0 (oldest) .. w3 (newest); works per 128-bit lane. W[t+3]
+ * depends on W[t], so it is computed with a zero first and fixed up after.
+ */
+#define SHA1_SCHEDULE(PFX, alignr, srli, slli, srli32, slli32, xor_, w0, w1, w2, w3) \
+	do { \
+		PFX x = xor_(xor_(w0, alignr(w1, w0, 8)), xor_(w2, srli(w3, 4))); \
+		PFX r = xor_(slli32(x, 1), srli32(x, 31)); \
+		PFX fix = slli(r, 12); \
+		r = xor_(r, xor_(slli32(fix, 1), srli32(fix, 31))); \
+		w0 = w1; w1 = w2; w2 = w3; w3 = r; \
+	} while(0)
+
+//! \brief Round functions
+#define SHA1_F1(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define SHA1_F2(b, c, d) ((b) ^ (c) ^ (d))
+#define SHA1_F3(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+
+/*
+ * A single round; rather than moving every variable one place down, the
+ * caller rotates the names, so that a is the current A.
+ */
+#define SHA1_ROUND(f, a, b, c, d, e, wk) \
+	e += ROTATE(5, a) + f(b, c, d) + (wk); \
+	b = ROTATE(30, b);
+
+/*
+ * Twenty rounds starting at round t; sched(n) is invoked after every four
+ * rounds, so that the vector unit can calculate the schedule words needed
+ * later while the integer unit runs the rounds.
+ */
+#define SHA1_ROUNDS20(f, t, wk, sched) \
+	SHA1_ROUND(f, A, B, C, D, E, wk[t +  0]); SHA1_ROUND(f, E, A, B, C, D, wk[t +  1]); \
+	SHA1_ROUND(f, D, E, A, B, C, wk[t +  2]); SHA1_ROUND(f, C, D, E, A, B, wk[t +  3]); \
+	sched(t +  0); \
+	SHA1_ROUND(f, B, C, D, E, A, wk[t +  4]); SHA1_ROUND(f, A, B, C, D, E, wk[t +  5]); \
+	SHA1_ROUND(f, E, A, B, C, D, wk[t +  6]); SHA1_ROUND(f, D, E, A, B, C, wk[t +  7]); \
+	sched(t +  4); \
+	SHA1_ROUND(f, C, D, E, A, B, wk[t +  8]); SHA1_ROUND(f, B, C, D, E, A, wk[t +  9]); \
+	SHA1_ROUND(f, A, B, C, D, E, wk[t + 10]); SHA1_ROUND(f, E, A, B, C, D, wk[t + 11]); \
+	sched(t +  8); \
+	SHA1_ROUND(f, D, E, A, B, C, wk[t + 12]); SHA1_ROUND(f, C, D, E, A, B, wk[t + 13]); \
+	SHA1_ROUND(f, B, C, D, E, A, wk[t + 14]); SHA1_ROUND(f, A, B, C, D, E, wk[t + 15]); \
+	sched(t + 12); \
+	SHA1_ROUND(f, E, A, B, C, D, wk[t + 16]); SHA1_ROUND(f, D, E, A, B, C, wk[t + 17]); \
+	SHA1_ROUND(f, C, D, E, A, B, wk[t + 18]); SHA1_ROUND(f, B, C, D, E, A, wk[t + 19]); \
+	sched(t + 16);
+
+//! \brief All 80 rounds over a block, adding the result to H
+#define SHA1_ROUNDS80(H, wk, sched) \
+	do { \
+		uint32_t A = H[0], B = H[1], C = H[2], D = H[3], E = H[4]; \
+		SHA1_ROUNDS20(SHA1_F1,  0, wk, sched); \
+		SHA1_ROUNDS20(SHA1_F2, 20, wk, sched); \
+		SHA1_ROUNDS20(SHA1_F3, 40, wk, sched); \
+		SHA1_ROUNDS20(SHA1_F2, 60, wk, sched); \
+		H[0] += A; H[1] += B; H[2] += C; H[3] += D; H[4] += E; \
+	} while(0)
+
+//! \brief Schedule step that does nothing, for rounds of precalculated words
+#define SHA1_NO_SCHEDULE(t)
+
+void SHA1_TARGET("ssse3")
+Tortilla::sha1_blocks_ssse3(uint32_t* H, const uint8_t* data, size_t numBlocks)
+{
+	const __m128i mask = SHA1_BSWAP_MASK;
+
+	/*
+	 * Rounds t..t+3 are followed by the calculation of W[t+16..t+19]; these
+	 * words are only needed twelve rounds later, so neither has to wait for
+	 * the other.
+	 */
+#define SCHEDULE(t) \
+	if ((t) + 16 < 80) { \
+		SHA1_SCHEDULE(__m128i, _mm_alignr_epi8, _mm_srli_si128, _mm_slli_si128, \
+		 _mm_srli_epi32, _mm_slli_epi32, _mm_xor_si128, w0, w1, w2, w3); \
+		_mm_store_si128((__m128i*)&wk[(t) + 16], _mm_add_epi32(w3, _mm_set1_epi32(SHA1_K((t) + 16)))); \
+	}
+
+	for (/* nothing */; numBlocks > 0; numBlocks--, data += 64) {
+		uint32_t wk[80] __attribute__((aligned(16)));
+		__m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data +  0)), mask);
+		__m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+		__m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+		__m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+		const __m128i k0 = _mm_set1_epi32(SHA1_K(0));
+		_mm_store_si128((__m128i*)&wk[ 0], _mm_add_epi32(w0, k0));
+		_mm_store_si128((__m128i*)&wk[ 4], _mm_add_epi32(w1, k0));
+		_mm_store_si128((__m128i*)&wk[ 8], _mm_add_epi32(w2, k0));
+		_mm_store_si128((__m128i*)&wk[12], _mm_add_epi32(w3, k0));
+		SHA1_ROUNDS80(H, wk, SCHEDULE);
+	}
+
+#undef SCHEDULE
+}
+
+void SHA1_TARGET("avx2,bmi,bmi2")
+Tortilla::sha1_blocks_avx2(uint32_t* H, const uint8_t* data, size_t numBlocks)
+{
+	/*
+	 * The schedule of two blocks is calculated at once, one per 128-bit lane,
+	 * while running the rounds of the first block; the second block then only
+	 * needs its rounds.
+	 */
+	const __m256i mask = _mm256_broadcastsi128_si256(SHA1_BSWAP_MASK);
+
+#define LOAD(i) \
+	_mm256_shuffle_epi8(_mm256_inserti128_si256( \
+	 _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(data + (i) * 16))), \
+	 _mm_loadu_si128((const __m128i*)(data + 64 + (i) * 16)), 1), mask)
+#define STORE(t, v) \
+	do { \
+		__m256i sum = _mm256_add_epi32(v, _mm256_set1_epi32(SHA1_K(t))); \
+		_mm_store_si128((__m128i*)&wk[t], _mm256_castsi256_si128(sum)); \
+		_mm_store_si128((__m128i*)&wk2[t], _mm256_extracti128_si256(sum, 1)); \
+	} while(0)
+#define SCHEDULE(t) \
+	if ((t) + 16 < 80) { \
+		SHA1_SCHEDULE(__m256i, _mm256_alignr_epi8, _mm256_srli_si256, _mm256_slli_si256, \
+		 _mm256_srli_epi32, _mm256_slli_epi32, _mm256_xor_si256, w0, w1, w2, w3); \
+		STORE((t) + 16, w3); \
+	}
+
+	for (/* nothing */; numBlocks >= 2; numBlocks -= 2, data += 128) {
+		uint32_t wk[80] __attribute__((aligned(16)));
+		uint32_t wk2[80] __attribute__((aligned(16)));
+		__m256i w0 = LOAD(0), w1 = LOAD(1), w2 = LOAD(2), w3 = LOAD(3);
+		STORE(0, w0); STORE(4, w1); STORE(8, w2); STORE(12, w3);
+		SHA1_ROUNDS80(H, wk, SCHEDULE);
+		SHA1_ROUNDS80(H, wk2, SHA1_NO_SCHEDULE);
+	}
+
+#undef SCHEDULE
+#undef STORE
+#undef LOAD
+
+	/* Any odd block is handled on its own */
+	if (numBlocks > 0)
+		sha1_blocks_ssse3(H, data, numBlocks);
+}
+
+void SHA1_TARGET("sha,ssse3,sse4.1")
+Tortilla::sha1_blocks_shani(uint32_t* H, const uint8_t* data, size_t numBlocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+	/* The instructions want A in the most significant word, E separately */
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)H), 0x1b);
+	__m128i e0 = _mm_set_epi32(H[4], 0, 0, 0);
+	__m128i e1;
+
+/*
+ * Four rounds using round function f; the E value for these rounds is
+ * derived from A four rounds earlier, which e_cur holds on entry.
+ */
+#define RNDS4(e_cur, e_next, msg, f) \
+	e_cur = _mm_sha1nexte_epu32(e_cur, msg); \
+	e_next = abcd; \
+	abcd = _mm_sha1rnds4_epu32(abcd, e_cur, f);
+
+//! \brief Computes the next four schedule words into m0 (holding the oldest)
+#define MSG4(m0, m1, m2, m3) \
+	m0 = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(m0, m1), m2), m3);
+
+	for (/* nothing */; numBlocks > 0; numBlocks--, data += 64) {
+		__m128i abcd_save = abcd, e0_save = e0;
+		__m128i m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data +  0)), mask);
+		__m128i m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+		__m128i m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+		__m128i m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+
+		/* Rounds 0-3 have no earlier A to derive E from */
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		RNDS4(e1, e0, m1, 0);                       /* 4-7 */
+		RNDS4(e0, e1, m2, 0);                       /* 8-11 */
+		RNDS4(e1, e0, m3, 0);                       /* 12-15 */
+		MSG4(m0, m1, m2, m3); RNDS4(e0, e1, m0, 0); /* 16-19 */
+		MSG4(m1, m2, m3, m0); RNDS4(e1, e0, m1, 1); /* 20-23 */
+		MSG4(m2, m3, m0, m1); RNDS4(e0, e1, m2, 1); /* 24-27 */
+		MSG4(m3, m0, m1, m2); RNDS4(e1, e0, m3, 1); /* 28-31 */
+		MSG4(m0, m1, m2, m3); RNDS4(e0, e1, m0, 1); /* 32-35 */
+		MSG4(m1, m2, m3, m0); RNDS4(e1, e0, m1, 1); /* 36-39 */
+		MSG4(m2, m3, m0, m1); RNDS4(e0, e1, m2, 2); /* 40-43 */
+		MSG4(m3, m0, m1, m2); RNDS4(e1, e0, m3, 2); /* 44-47 */
+		MSG4(m0, m1, m2, m3); RNDS4(e0, e1, m0, 2); /* 48-51 */
+		MSG4(m1, m2, m3, m0); RNDS4(e1, e0, m1, 2); /* 52-55 */
+		MSG4(m2, m3, m0, m1); RNDS4(e0, e1, m2, 2); /* 56-59 */
+		MSG4(m3, m0, m1, m2); RNDS4(e1, e0, m3, 3); /* 60-63 */
+		MSG4(m0, m1, m2, m3); RNDS4(e0, e1, m0, 3); /* 64-67 */
+		MSG4(m1, m2, m3, m0); RNDS4(e1, e0, m1, 3); /* 68-71 */
+		MSG4(m2, m3, m0, m1); RNDS4(e0, e1, m2, 3); /* 72-75 */
+		MSG4(m3, m0, m1, m2); RNDS4(e1, e0, m3, 3); /* 76-79 */
+
+		/* Add this block's result to the intermediate hash */
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+#undef MSG4
+#undef RNDS4
+
+	_mm_storeu_si128((__m128i*)H, _mm_shuffle_epi32(abcd, 0x1b));
+	H[4] = _mm_extract_epi32(e0, 3);
+}
+
+#endif /* SHA1_HAVE_X86 */
+
+/* vim:set ts=2 sw=2: */
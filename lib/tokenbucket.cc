@@ -0,0 +1,102 @@
+#include <boost/thread/locks.hpp>
+#include <time.h>
+#include "tokenbucket.h"
+
+using namespace std;
+using namespace boost;
+using namespace Tortilla;
+
+TokenBucket::TokenBucket(uint32_t r)
+	: rate(0), burst(0), tokens(0), lastRefill(0)
+{
+	setRate(r);
+}
+
+void
+TokenBucket::setRate(uint32_t r)
+{
+	unique_lock<mutex> lock(mtx_data);
+	if (rate > 0)
+		refill();
+
+	/* Start out with a full bucket if we weren't limiting before */
+	bool wasLimited = rate > 0;
+	rate = r;
+	burst = (uint64_t)rate * TOKENBUCKET_BURST_TIME / 1000;
+	if (burst < TOKENBUCKET_MIN_QUANTUM)
+		burst = TOKENBUCKET_MIN_QUANTUM;
+	if (!wasLimited || tokens > burst)
+		tokens = burst;
+	lastRefill = getTime();
+}
+
+uint32_t
+TokenBucket::getRate() const
+{
+	unique_lock<mutex> lock(mtx_data);
+	return rate;
+}
+
+void
+TokenBucket::refill()
+{
+	uint64_t now = getTime();
+	uint64_t elapsed = now - lastRefill;
+
+	/* Only account for whole tokens, so that no time is lost to rounding */
+	uint64_t earned = elapsed * rate / 1000000;
+	if (earned == 0)
+		return;
+	lastRefill += earned * 1000000 / rate;
+	tokens += earned;
+	if (tokens >= burst) {
+		tokens = burst;
+		lastRefill = now;
+	}
+}
+
+ssize_t
+TokenBucket::getAvailable(uint64_t& delay)
+{
+	unique_lock<mutex> lock(mtx_data);
+	if (rate == 0)
+		return -1;
+
+	refill();
+	if (tokens >= TOKENBUCKET_MIN_QUANTUM)
+		return tokens;
+
+	/* Figure out when we'll have enough tokens, rounding up */
+	uint64_t needed = TOKENBUCKET_MIN_QUANTUM - tokens;
+	delay = (needed * 1000000 + rate - 1) / rate;
+	return 0;
+}
+
+void
+TokenBucket::consume(size_t amount)
+{
+	unique_lock<mutex> lock(mtx_data);
+	if (rate == 0)
+		return;
+	tokens -= amount;
+}
+
+ssize_t
+TokenBucket::limit(ssize_t a, ssize_t b)
+{
+	if (a < 0)
+		return b;
+	if (b < 0)
+		return a;
+	return (a < b) ? a : b;
+}
+
+uint64_t
+TokenBucket::getTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* vim:set ts=2 sw=2: */
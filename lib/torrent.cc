@@ -24,6 +24,7 @@
 #include "overseer.h"
 #include "peer.h"
 #include "pendingpeer.h"
+#include "piecebuffer.h"
 #include "sha1.h"
 #include "tracer.h"
 #include "torrent.h"
@@ -77,14 +78,12 @@ Torrent::Torrent(Overseer* o, Metadata* md, std::string path)
 	memcpy(pieceHash, miPieces->getString().c_str(), numPieces * TORRENT_HASH_LEN);
 
 	/* For now, assume we have no pieces, requested none and are hashing none */
-	havePiece.reserve(numPieces);
-	hashingPiece.reserve(numPieces);
-	pieceCardinality.reserve(numPieces);
-	for (unsigned int i = 0; i < numPieces; i++) {
-		havePiece.push_back(false);
-		hashingPiece.push_back(false);
-		pieceCardinality.push_back(0);
-	}
+	havePiece.resize(numPieces);
+	hashingPiece.resize(numPieces);
+	numChunksReceived.resize(numPieces, 0);
+	numPiecesComplete = 0;
+	bufferedBytes = 0;
+	picker = new PiecePicker(numPieces);
 
 	/*
 	 * Construct the chunk overview. XXX ideally, TORRENT_CHUNK_SIZE should be
@@ -93,15 +92,9 @@ Torrent::Torrent(Overseer* o, Metadata* md, std::string path)
 	 */
 	if (pieceLen % TORRENT_CHUNK_SIZE != 0)
 		throw TorrentException("torrent piece length is not a multiple of chunk size!");
-	int numChunks = pieceLen;
-	haveChunk.reserve(numChunks);
-	haveRequestedChunk.reserve(numChunks);
-	for (unsigned int i = 0; i < numPieces; i++) {
-		for (unsigned int j = 0; j < pieceLen / TORRENT_CHUNK_SIZE; j++) {
-			haveChunk.push_back(havePiece[i]);
-			haveRequestedChunk.push_back(PeerList());
-		}
-	}
+	unsigned int numChunks = numPieces * (pieceLen / TORRENT_CHUNK_SIZE);
+	haveChunk.resize(numChunks);
+	requestedChunk.resize(numChunks);
 
 	/*
 	 * Construct the list of files. There are two possibilities:
@@ -238,6 +231,7 @@ Torrent::Torrent(Overseer* o, Metadata* md, std::string path)
 	unsigned int piecenum = 0;
 	unsigned int leftoverLength = 0;
 	numPiecesHashing = 0;
+	numConnectsQueued = 0; numConnectsHalfOpen = 0;
 	bool previousFileReopened = false /* quench warning, can't be used */;
 	for (unsigned int i = 0; i < files.size(); i++) {
 		File* f = files[i];
@@ -257,7 +251,7 @@ Torrent::Torrent(Overseer* o, Metadata* md, std::string path)
 			}
 
 			/* This file is big enough to process the previous missing pieces */
-			havePiece[piecenum] = previousFileReopened && f->haveReopened();
+			havePiece.set(piecenum, previousFileReopened && f->haveReopened());
 			if (havePiece[piecenum] && !restoredStatus) {
 				scheduleHashing(piecenum, true);
 			}
@@ -273,7 +267,7 @@ Torrent::Torrent(Overseer* o, Metadata* md, std::string path)
 		 * full pieces in order here.
 		 */
 		while (fileLength > pieceLen) {
-			havePiece[piecenum] = f->haveReopened();
+			havePiece.set(piecenum, f->haveReopened());
 			if (f->haveReopened() && !restoredStatus)
 				scheduleHashing(piecenum, true);
 			piecenum++;
@@ -287,7 +281,7 @@ Torrent::Torrent(Overseer* o, Metadata* md, std::string path)
 
 	/* If the final file has leftover pieces, add an extra full piece to cope */
 	if (leftoverLength > 0) {
-		havePiece[piecenum] = previousFileReopened;
+		havePiece.set(piecenum, previousFileReopened);
 		if (havePiece[piecenum] && !restoredStatus)
 			scheduleHashing(piecenum, true);
 		piecenum++;
@@ -297,6 +291,23 @@ Torrent::Torrent(Overseer* o, Metadata* md, std::string path)
 	 * We must have processed as many pieces as there are in the file.
 	 */
 	assert(piecenum == numPieces);
+
+	/*
+	 * Don't pick the pieces we have, and count the ones that need no hashing.
+	 * Hashing may already have completed or rejected some of them, so only
+	 * look at what we have now.
+	 */
+	{
+		unique_lock<mutex> lock(mtx_data);
+		numPiecesComplete = 0;
+		for (unsigned int i = 0; i < numPieces; i++) {
+			if (!havePiece[i])
+				continue;
+			picker->setWanted(i, false);
+			if (!hashingPiece[i])
+				numPiecesComplete++;
+		}
+	}
 }
 
 Torrent::~Torrent()
@@ -304,6 +315,9 @@ Torrent::~Torrent()
 	/* Cancel any hashing attempt, as we'll close the files soon enough */
 	overseer->cancelHashing(this);
 
+	/* Ensure no new peers will be added */
+	overseer->cancelConnecting(this);
+
 	/*
 	 * Remove our peers; actual cleanup will be handled by the overseer.
 	 */
@@ -338,6 +352,10 @@ Torrent::~Torrent()
 		delete pp;
 	}
 	delete[] pieceHash;
+	delete picker;
+	for (map<unsigned int, PieceBuffer*>::iterator it = pieceBuffers.begin();
+	     it != pieceBuffers.end(); it++)
+		delete it->second;
 
 	delete torrentDictionary;
 	delete trackerTalker;
@@ -511,17 +529,42 @@ Torrent::handleTrackerReply(string reply)
 void
 Torrent::callbackPiecesAdded(Peer* p, vector<unsigned int>& pieces)
 {
-	{
-		unique_lock<mutex> lock(mtx_data);
-		for (vector<unsigned int>::iterator it = pieces.begin();
-				 it != pieces.end(); it++) {
-			assert(*it < numPieces);
-			pieceCardinality[*it]++;
-		}
+	unique_lock<mutex> lock(mtx_data);
+	for (vector<unsigned int>::iterator it = pieces.begin();
+			 it != pieces.end(); it++) {
+		assert(*it < numPieces);
+		if (p->havePiece[*it])
+			continue;
+		p->havePiece.set(*it);
+		picker->addAvailability(*it);
+		if (!havePiece[*it])
+			p->numWantedPieces++;
 	}
 
 	/* Use this to signal interest in a peer */
-	processPeerStatus();
+	if (p->numWantedPieces > 0)
+		p->claimInterest();
+}
+
+void
+Torrent::updateWantedPieces(unsigned int piece, bool have)
+{
+	shared_lock<shared_mutex> lock(rwl_peers);
+	for (vector<Peer*>::iterator it = peers.begin();
+	     it != peers.end(); it++) {
+		Peer* p = (*it);
+		if (!p->havePiece[piece])
+			continue;
+
+		if (have) {
+			assert(p->numWantedPieces > 0);
+			if (--p->numWantedPieces == 0)
+				p->revokeInterest();
+		} else {
+			if (p->numWantedPieces++ == 0)
+				p->claimInterest();
+		}
+	}
 }
 
 void
@@ -531,8 +574,7 @@ Torrent::callbackPiecesRemoved(Peer* p, vector<unsigned int>& pieces)
 	for (vector<unsigned int>::iterator it = pieces.begin();
 	     it != pieces.end(); it++) {
 		assert(*it < numPieces);
-		assert(pieceCardinality[*it] > 0);
-		pieceCardinality[*it]--;
+		picker->removeAvailability(*it);
 	}
 }
 
@@ -548,27 +590,34 @@ Torrent::schedulePeerRequests(Peer* p)
 		return;
 
 	/*
-	 * XXX this algorithm should schedule a piece more randomly
+	 * Have the picker come up with a few pieces the peer has, and try them in
+	 * order until we get to request something. Pieces of which every chunk is
+	 * already requested don't get us anywhere; if we only find those, try more
+	 * pieces.
 	 */
-	for (unsigned int i = 0; i < numPieces && !terminating; i++) {
-		bool b;
+	set<unsigned int> tried;
+	unsigned int max = TORRENT_PICK_CANDIDATES;
+	while (!terminating) {
+		vector<unsigned int> pieces;
 		{
 			unique_lock<mutex> lock(mtx_data);
-			b = havePiece[i] || !p->hasPiece(i);
+			picker->pick(p->havePiece, tried, pieces, max);
 		}
-		if (b)
-			continue;
+		if (pieces.empty())
+			break;
 
 		/*
-		 * We don't have the piece, but this peer does. Find a piece, and go
-		 * request.
+		 * We don't have these pieces, but this peer does. Find a piece, and go
+		 * request. If the peer can't take any more requests, we are done.
 		 */
 		assert(p->isInterested());
-
-		int result = p->sendPieceRequest(i);
-		if (result > 0) {
-			break;
+		for (vector<unsigned int>::iterator it = pieces.begin(); it != pieces.end(); it++) {
+			int result = p->sendPieceRequest(*it);
+			if (result != 0)
+				return;
+			tried.insert(*it);
 		}
+		max *= 2;
 	}
 }
 
@@ -592,38 +641,121 @@ Torrent::getMissingChunk(Peer* p, unsigned int piece)
 		if (haveChunk[chunkIndex])
 			continue;
 
-		/* If we aren't doing endgame mode, don't request the chunk from >1 peer */
-		if (!endgame_mode && haveRequestedChunk[chunkIndex].size() > 0)
-			continue;
+		if (requestedChunk[chunkIndex]) {
+			/* If we aren't doing endgame mode, don't request the chunk from >1 peer */
+			if (!endgame_mode)
+				continue;
 
-		/* Only request the chunk if we haven't already done so from this peer */
-		if (find(haveRequestedChunk[chunkIndex].begin(),
-		         haveRequestedChunk[chunkIndex].end(),
-		         p) == haveRequestedChunk[chunkIndex].end()) {
-		  haveRequestedChunk[chunkIndex].push_back(p);
-			return j;
+			/* Only request the chunk if we haven't already done so from this peer */
+			if (p->isRequestingChunk(piece, j * TORRENT_CHUNK_SIZE))
+				continue;
+			duplicateChunkRequests[chunkIndex]++;
+		} else {
+			requestedChunk.set(chunkIndex);
 		}
+		picker->setPartial(piece, true);
+		return j;
 	}
 
 	return -1;
 }
 
+void
+Torrent::releaseChunkRequest(unsigned int chunkIndex)
+{
+	map<unsigned int, unsigned int>::iterator it = duplicateChunkRequests.find(chunkIndex);
+	if (it == duplicateChunkRequests.end()) {
+		requestedChunk.set(chunkIndex, false);
+		return;
+	}
+	if (--it->second == 0)
+		duplicateChunkRequests.erase(it);
+}
+
+void
+Torrent::callbackChunkRequestDone(Peer* p, unsigned int piece, uint32_t offset)
+{
+	unique_lock<mutex> lock(mtx_data);
+	releaseChunkRequest((piece * (pieceLen / TORRENT_CHUNK_SIZE)) + (offset / TORRENT_CHUNK_SIZE));
+}
+
+void
+Torrent::callbackChunkRequestsDropped(Peer* p, const set<OutstandingChunkRequest>& requests)
+{
+	unique_lock<mutex> lock(mtx_data);
+	for (set<OutstandingChunkRequest>::const_iterator it = requests.begin();
+	     it != requests.end(); it++) {
+		releaseChunkRequest((it->getPiece() * (pieceLen / TORRENT_CHUNK_SIZE)) + (it->getOffset() / TORRENT_CHUNK_SIZE));
+	}
+}
+
 void
 Torrent::callbackCompletePiece(Peer* p, unsigned int piece)
 {
 	assert(piece < numPieces);
-	{
-		unique_lock<mutex> lock(mtx_data);
-		assert(!havePiece[piece]);
-		havePiece[piece] = true;
+
+	/*
+	 * The piece has been hashed while it came in, so we can verify it right
+	 * away. Nothing else touches the buffer once the piece is complete.
+	 */
+	PieceBuffer* pb = getPieceBuffer(piece);
+	if (pb != NULL && pb->isHashed()) {
+		bool ok = memcmp(pb->getHasher().getHash(), getPieceHash(piece), TORRENT_HASH_LEN) == 0;
+		TRACE(HASHER, "hashing completed inline: torrent=%p,piece=%u,ok=%u", this, piece, ok ? 1 : 0);
+		callbackCompleteHashing(piece, ok);
+		return;
 	}
 
 	/*
 	 * Ask the hasher to verify this chunk - once it is done, we use
 	 * the callback to figure out whether we have to refetch the piece or accept
-	 * that we think it's fine.
+	 * that we think it's fine. The piece was marked as being hashed when it
+	 * was claimed.
 	 */
-	scheduleHashing(piece);
+	overseer->queueHashPiece(this, piece, false);
+}
+
+uint32_t
+Torrent::calculatePieceLength(unsigned int piece) const
+{
+	assert(piece < numPieces);
+
+	if (piece < numPieces - 1 || total_size % pieceLen == 0)
+		return pieceLen;
+	return total_size % pieceLen;
+}
+
+PieceBuffer*
+Torrent::getPieceBuffer(unsigned int piece) const
+{
+	unique_lock<mutex> lock(mtx_data);
+	map<unsigned int, PieceBuffer*>::const_iterator it = pieceBuffers.find(piece);
+	return it != pieceBuffers.end() ? it->second : NULL;
+}
+
+PieceBuffer*
+Torrent::obtainPieceBuffer(unsigned int piece)
+{
+	map<unsigned int, PieceBuffer*>::iterator it = pieceBuffers.find(piece);
+	if (it != pieceBuffers.end())
+		return it->second;
+
+	/*
+	 * Pieces that already have chunks in the output files, such as those
+	 * restored by restoreStatus(), are completed there; this saves reading
+	 * the chunks back. The same goes for pieces beyond our memory budget.
+	 */
+	unsigned int first = piece * (pieceLen / TORRENT_CHUNK_SIZE);
+	if (haveChunk.findNext(first) < first + calculateChunksInPiece(piece))
+		return NULL;
+	uint32_t len = calculatePieceLength(piece);
+	if (bufferedBytes + len > TORRENT_MAX_BUFFERED)
+		return NULL;
+
+	PieceBuffer* pb = new PieceBuffer(len);
+	pieceBuffers[piece] = pb;
+	bufferedBytes += len;
+	return pb;
 }
 
 unsigned int
@@ -647,65 +779,124 @@ Torrent::callbackCompleteChunk(Peer* p, unsigned int piece, uint32_t offset, con
 	assert (len <= TORRENT_CHUNK_SIZE);
 	assert (offset % TORRENT_CHUNK_SIZE == 0);
 
+	/* Don't let anyone write beyond the end of the piece */
+	if (offset + len > calculatePieceLength(piece)) {
+		TRACE(TORRENT, "chunk beyond piece, piece=%u, offset=%u, len=%u", piece, offset, len);
+		return;
+	}
+
+	unsigned int chunkIndex = (piece * (pieceLen / TORRENT_CHUNK_SIZE)) + offset / TORRENT_CHUNK_SIZE;
+	bool ignore, buffered = false, pendingComplete = false;
 	{
 		unique_lock<mutex> lock(mtx_data);
-		if (havePiece[piece]) {
-			/*
-			 * This can happen in endgame mode; if we have requested a piece but
-			 * couldn't cancel it anymore (or if we are too late), we may get the
-			 * last data while we are hashing. If this happens, just ignore the
-			 * data alltogether.
-			 */
-			mtx_data.unlock();
-			schedulePeerRequests(p);
-			return;
-		}
 
 		/*
-		 * Immediately mark the chunk as completed; this prevents anyone else from
-		 * scheduling it.
+		 * This can happen in endgame mode; if we have requested a piece but
+		 * couldn't cancel it anymore (or if we are too late), we may get the
+		 * last data while we are hashing. If this happens, just ignore the
+		 * data alltogether. The same goes for a chunk we already have.
 		 */
-		haveChunk[(piece * (pieceLen / TORRENT_CHUNK_SIZE)) + offset / TORRENT_CHUNK_SIZE] = true;
-	}
+		ignore = havePiece[piece] || haveChunk[chunkIndex];
 
-	if (!writeChunk(piece, offset, data, len)) {
-		TRACE(TORRENT, "unable to write chunk, piece=%lu, offset=%lu, len=%lu", piece, offset, len);
-		{
-			unique_lock<mutex> lock(mtx_data);
-			haveChunk[(piece * (pieceLen / TORRENT_CHUNK_SIZE)) + offset / TORRENT_CHUNK_SIZE] = false;
+		/*
+		 * Place the chunk in the piece buffer and immediately mark the chunk as
+		 * completed; this prevents anyone else from scheduling it. Buffered
+		 * pieces are written once they are complete and hashed.
+		 */
+		if (!ignore) {
+			PieceBuffer* pb = obtainPieceBuffer(piece);
+			haveChunk.set(chunkIndex, true);
+			if (pb != NULL) {
+				buffered = true;
+				pb->store(offset, data, len);
+				numChunksReceived[piece]++;
+
+				/*
+				 * If this chunk follows what has been hashed, hash it along with
+				 * anything after it; the lock is dropped meanwhile. Should the piece
+				 * be completed in the mean time, it is up to us to finish it.
+				 */
+				if (pb->claimHasher()) {
+					pb->hash(lock);
+					pendingComplete = pb->isPendingComplete();
+				}
+			}
 		}
 	}
+	if (ignore) {
+		schedulePeerRequests(p);
+		return;
+	}
 
 	/*
-	 * If anyone else is downloading this chunk, cancel it. Same goes for any
-	 * REQUEST messages we may have queued but not sent.
+	 * Pieces that aren't kept in memory are written chunk by chunk; such a
+	 * chunk only counts once it is in the output files.
 	 */
+	bool written = buffered;
+	if (!buffered) {
+		written = writeChunk(piece, offset, data, len);
+		if (!written)
+			TRACE(TORRENT, "unable to write chunk, piece=%u, offset=%u, len=%u", piece, offset, len);
+	}
+
+	/*
+	 * If anyone else is downloading this chunk, cancel it. There is no need to
+	 * look at uploads, as we only upload pieces that are verified.
+	 */
+	unsigned int numCancelled = 0;
 	{
 		shared_lock<shared_mutex> lock(rwl_peers);
 		for (vector<Peer*>::iterator it = peers.begin();
 				 it != peers.end(); it++) {
 			Peer* p = (*it);
-			p->cancelChunk(piece, offset, len);
-			p->cancelChunkRequest(piece, offset, len);
+			if (p->cancelChunk(piece, offset, len))
+				numCancelled++;
 		}
 	}
 
-	bool full = true;
+	bool full;
 	{
 		unique_lock<mutex> lock(mtx_data);
 		downloaded += len;
+		for (unsigned int i = 0; i < numCancelled; i++)
+			releaseChunkRequest(chunkIndex);
+		if (!buffered) {
+			if (written)
+				numChunksReceived[piece]++;
+			else
+				haveChunk.set(chunkIndex, false);
+		}
 
 		/* See if we have all chunks; if so, the piece is in */
-		for (unsigned int i = 0; i < calculateChunksInPiece(piece); i++) {
-			if (!haveChunk[(piece * (pieceLen / TORRENT_CHUNK_SIZE)) + i]) {
+		full = numChunksReceived[piece] == calculateChunksInPiece(piece);
+
+		/*
+		 * Peers may be serviced by different receivers, so multiple peers can
+		 * deliver the final chunks of a piece at the same time; only the first
+		 * one to notice gets to complete it.
+		 *
+		 * The piece is marked as being hashed along with claiming it, so that it
+		 * will not be uploaded before it is verified.
+		 */
+		if (full && havePiece[piece])
+			full = false;
+		if (full) {
+			havePiece.set(piece, true);
+			hashingPiece.set(piece, true);
+			picker->setWanted(piece, false);
+			updateWantedPieces(piece, true);
+
+			/* If the final chunks are still being hashed, the hasher completes it */
+			map<unsigned int, PieceBuffer*>::iterator it = pieceBuffers.find(piece);
+			if (it != pieceBuffers.end() && it->second->isHashing()) {
+				it->second->setPendingComplete();
 				full = false;
-				break;
 			}
 		}
 	}
 
 	schedulePeerRequests(p);
-	if (!full)
+	if (!full && !pendingComplete)
 		return;
 
 	/* Yay! */
@@ -727,15 +918,53 @@ Torrent::hasPiece(unsigned int piece) const
 	return b;
 }
 
+Bitfield
+Torrent::getPieceMap() const
+{
+	unique_lock<mutex> lock(mtx_data);
+	return havePiece;
+}
+
+bool
+Torrent::canUploadPiece(unsigned int piece) const
+{
+	assert (piece < numPieces);
+
+	/*
+	 * A piece is claimed as soon as its final chunk arrives; until hashing is
+	 * done, it may be corrupt or still only live in memory.
+	 */
+	unique_lock<mutex> lock(mtx_data);
+	return havePiece[piece] && !hashingPiece[piece];
+}
+
 void
 Torrent::callbackCompleteHashing(unsigned int piece, bool result)
 {
+	/*
+	 * If we just downloaded the piece, it only lives in memory; write it out if
+	 * the hash checks out. Nothing else touches the buffer once the piece is
+	 * complete, so there is no need to hold the lock while writing.
+	 */
+	PieceBuffer* pb = getPieceBuffer(piece);
+	if (pb != NULL && result && !writeChunk(piece, 0, pb->getData(), pb->getLength())) {
+		TRACE(TORRENT, "unable to write piece, piece=%u", piece);
+		result = false;
+	}
+
+	bool allComplete;
 	{
 		unique_lock<mutex> lock(mtx_data);
 		if (numPiecesHashing > 0)
 			numPiecesHashing--;
 
-		hashingPiece[piece] = false;
+		if (pb != NULL) {
+			pieceBuffers.erase(piece);
+			bufferedBytes -= pb->getLength();
+			delete pb;
+		}
+
+		hashingPiece.set(piece, false);
 		if (!result) {
 			/*
 			 * We got a corrupted piece! Mark it as not-available; we'll automatically
@@ -743,7 +972,9 @@ Torrent::callbackCompleteHashing(unsigned int piece, bool result)
 			 *
 			 * XXX we should identify and ban seeders that provide us with bad content.
 			 */
-			havePiece[piece] = false;
+			havePiece.set(piece, false);
+			picker->setWanted(piece, true);
+			updateWantedPieces(piece, false);
 
 			/*
 			 * Furthermore, we need to clear the individual 'have chunk' too,
@@ -751,13 +982,15 @@ Torrent::callbackCompleteHashing(unsigned int piece, bool result)
 			 * chunk is bad, but there is no way of knowing...)
 			 */
 			for (unsigned int j = 0; j < calculateChunksInPiece(piece); j++) {
-				haveChunk[(piece * (pieceLen / TORRENT_CHUNK_SIZE)) + j] = false;
+				haveChunk.set((piece * (pieceLen / TORRENT_CHUNK_SIZE)) + j, false);
 			}
+			numChunksReceived[piece] = 0;
 			return;
 		}
 
-		/* At least someone has this piece... we do! */
-		pieceCardinality[piece]++;
+		numPiecesComplete++;
+		allComplete = numPiecesComplete == numPieces;
+
 		if (piece == numPieces - 1) {
 			left -= getTotalSize() % pieceLen > 0 ?
 							getTotalSize() % pieceLen : pieceLen;
@@ -791,19 +1024,12 @@ Torrent::callbackCompleteHashing(unsigned int piece, bool result)
 		}
 	}
 
-	/* Try to use this as an attempt to signal disinterest in peers */
-	processPeerStatus();
-
 	/* Before we check the total state, tell the client we have yet another piece */
 	CALLBACK(completedPiece, this, piece);
 
 	/* If we have all pieces, rejoice */
-	{
-		unique_lock<mutex> lock(mtx_data);
-		for (unsigned int i = 0; i < numPieces; i++)
-			if (!havePiece[i] || hashingPiece[i])
-				return;
-	}
+	if (!allComplete)
+		return;
 
 	/* We have all pieces and are hashing none of them; torrent must be in */
 	complete = true;
@@ -811,11 +1037,24 @@ Torrent::callbackCompleteHashing(unsigned int piece, bool result)
 	callbackCompleteTorrent();
 }
 
+File*
+Torrent::locateFile(off_t& absolutePos, unsigned int& idx)
+{
+	for (idx = 0; idx < files.size(); idx++) {
+		if (absolutePos < files[idx]->getLength()) {
+			/* At least a part of the offset to handle resides in this file */
+			return files[idx];
+		}
+		absolutePos -= files[idx]->getLength();
+	}
+	return NULL;
+}
+
 bool
-Torrent::handleChunk(unsigned int piece, unsigned int offset, uint8_t* buf, size_t length, bool writing)
+Torrent::handleChunk(unsigned int piece, unsigned int offset, uint8_t* buf, size_t length, ChunkOperation op)
 {
 	assert(piece < numPieces);
-	assert(length <= TORRENT_CHUNK_SIZE);
+	assert(offset + length <= calculatePieceLength(piece));
 
 	/*
 	 * XXX this entire mess should be rewritten to use a tree structure; this
@@ -827,19 +1066,10 @@ Torrent::handleChunk(unsigned int piece, unsigned int offset, uint8_t* buf, size
 	off_t absolutePos = (off_t)piece * (off_t)pieceLen + (off_t)offset;
 
 	/* Locate the first file matching this position */
-	unsigned int idx = 0;
-	File* f = NULL;
+	unsigned int idx;
 	{
 		shared_lock<shared_mutex> lock(rwl_files);
-		while (idx < files.size()) {
-			if (absolutePos < files[idx]->getLength()) {
-				/* At least a part of the offset to handle resides in this file */
-				f = files[idx];
-				break;
-			}
-			absolutePos -= files[idx]->getLength();
-			idx++;
-		}
+		File* f = locateFile(absolutePos, idx);
 		if (f == NULL) {
 			/*
 			 * Invalid offset was presented - this should only happen if the
@@ -860,10 +1090,17 @@ Torrent::handleChunk(unsigned int piece, unsigned int offset, uint8_t* buf, size
 			 */
 			size_t partlen = std::min((size_t)(f->getLength() - absolutePos), length);
 			
-			if (writing)
-				overseer->writeFile(f, absolutePos, buf, partlen);
-			else
-				overseer->readFile(f, absolutePos, buf, partlen);
+			switch(op) {
+				case CHUNK_READ:
+					overseer->readFile(f, absolutePos, buf, partlen);
+					break;
+				case CHUNK_WRITE:
+					overseer->writeFile(f, absolutePos, buf, partlen);
+					break;
+				case CHUNK_PREFETCH:
+					overseer->prefetchFile(f, absolutePos, partlen);
+					break;
+			}
 
 			if (partlen != length) {
 				/* This operation spans multiple files, so use the next one */
@@ -879,16 +1116,57 @@ Torrent::handleChunk(unsigned int piece, unsigned int offset, uint8_t* buf, size
 	return true;
 }
 
+ssize_t
+Torrent::sendChunk(int sockfd, unsigned int piece, unsigned int offset, size_t length)
+{
+	if (piece >= numPieces || offset + length > calculatePieceLength(piece))
+		return -1;
+
+	off_t absolutePos = (off_t)piece * (off_t)pieceLen + (off_t)offset;
+	unsigned int idx;
+	ssize_t total = 0;
+	{
+		shared_lock<shared_mutex> lock(rwl_files);
+		File* f = locateFile(absolutePos, idx);
+		if (f == NULL)
+			return -1;
+
+		/* As with handleChunk(), the chunk may span multiple files */
+		while (length > 0) {
+			size_t partlen = std::min((size_t)(f->getLength() - absolutePos), length);
+			ssize_t sent = overseer->sendFile(f, sockfd, absolutePos, partlen);
+			if (sent < 0)
+				return (total > 0) ? total : -1;
+			total += sent; length -= sent;
+			if ((size_t)sent < partlen)
+				break; /* socket is full */
+
+			if (length > 0) {
+				idx++; assert(idx < files.size());
+				f = files[idx];
+				absolutePos = 0;
+			}
+		}
+	}
+	return total;
+}
+
 bool
 Torrent::writeChunk(unsigned int piece, unsigned int offset, const uint8_t* buf, size_t length)
 {
-	return handleChunk(piece, offset, (uint8_t*)buf, length, true);
+	return handleChunk(piece, offset, (uint8_t*)buf, length, CHUNK_WRITE);
 }
 
 bool
 Torrent::readChunk(unsigned int piece, unsigned int offset, uint8_t* buf, size_t length)
 {
-	return handleChunk(piece, offset, (uint8_t*)buf, length, false);
+	return handleChunk(piece, offset, (uint8_t*)buf, length, CHUNK_READ);
+}
+
+void
+Torrent::prefetchChunk(unsigned int piece, unsigned int offset, size_t length)
+{
+	handleChunk(piece, offset, NULL, length, CHUNK_PREFETCH);
 }
 
 const uint8_t*
@@ -926,11 +1204,11 @@ Torrent::scheduleHashing(unsigned int piece, bool registerHashing)
 	{
 		unique_lock<mutex> lock(mtx_data);
 		assert(!hashingPiece[piece]);
-		hashingPiece[piece] = true;
+		hashingPiece.set(piece, true);
 		if (registerHashing)
 			numPiecesHashing++;
 	}
-	overseer->queueHashPiece(this, piece);
+	overseer->queueHashPiece(this, piece, registerHashing);
 }
 
 void
@@ -1003,11 +1281,12 @@ Torrent::unregisterPeer(Peer* p)
 	 * Deregister any requested pieces by this peer. This results in these pieces
 	 * being rescheduled during a next call to schedulePeerRequests().
 	 */
+	set<OutstandingChunkRequest> dropped;
 	{
-		unique_lock<mutex> lock(mtx_data);
-		for (unsigned int j = 0; j < numPieces * (pieceLen / TORRENT_CHUNK_SIZE); j++)
-			haveRequestedChunk[j].remove_if(peervector_matches(p));
+		unique_lock<mutex> lock(p->mtx_data);
+		dropped.swap(p->chunk_requests);
 	}
+	callbackChunkRequestsDropped(p, dropped);
 
 	CALLBACK(removingPeer, this, p);
 }
@@ -1065,39 +1344,68 @@ Torrent::heartbeat()
 		handleUnchokingAlgorithm();
 	}
 
-	/* If we can fill up our peer slots, try it */
+	/*
+	 * If we can fill up our peer slots, try it; the connection manager will
+	 * get back to us once the connection is being made.
+	 */
 	while (true) {
 		unsigned int numPeers = getNumPeers();
-		if (numPeers >= TORRENT_DESIRED_PEERS)
-				break;
 
 		PendingPeer* pp;
 		{
 			unique_lock<mutex> lock(mtx_data);
+			if (numPeers + numConnectsQueued >= TORRENT_DESIRED_PEERS)
+				break;
+			if (numConnectsQueued + numConnectsHalfOpen >= TORRENT_MAX_HALFOPEN)
+				break;
 			if (pendingPeers.empty())
 				break;
 			pp = pendingPeers.front();
 			pendingPeers.pop_front();
+			numConnectsQueued++;
 		}
 
-		Peer* p = pp->connect();
-		delete pp;
+		overseer->connectPeer(pp);
+	}
+}
 
-		if (p != NULL) {
-			/*
-			 * It seems possible to connect to this peer; we should add it to both ourselves
-			 * and the overseer.
-			 */
-			registerPeer(p);
-			overseer->addPeer(p);
+void
+Torrent::callbackPeerConnecting(Peer* p)
+{
+	{
+		unique_lock<mutex> lock(mtx_data);
+		numConnectsQueued--; numConnectsHalfOpen++;
+	}
 
-			/*
-			 * Send the handshake; we can only do this after we have added the
-			 * peer since the Sender won't know of it otherwise.
-			 */
-			p->sendHandshake();
-		}
+	/*
+	 * It seems possible to connect to this peer; we should add it to both ourselves
+	 * and the overseer.
+	 */
+	registerPeer(p);
+	overseer->addPeer(p);
+
+	/*
+	 * Send the handshake; we can only do this after we have added the
+	 * peer since the Sender won't know of it otherwise.
+	 */
+	p->sendHandshake();
+}
+
+void
+Torrent::callbackPeerConnectFailed()
+{
+	unique_lock<mutex> lock(mtx_data);
+	numConnectsQueued--;
+}
+
+void
+Torrent::callbackPeerConnected(Peer* p)
+{
+	{
+		unique_lock<mutex> lock(mtx_data);
+		numConnectsHalfOpen--;
 	}
+	overseer->connectionDone();
 }
 
 void
@@ -1203,7 +1511,6 @@ Torrent::callbackPeerChangedChoking(Peer* p)
 void
 Torrent::processPeerStatus()
 {
-	unique_lock<mutex> lock_data(mtx_data);
 	shared_lock<shared_mutex> lock_peers(rwl_peers);
 
 	for (vector<Peer*>::iterator it = peers.begin();
@@ -1217,21 +1524,7 @@ Torrent::processPeerStatus()
 		if (complete && p->isSeeder()) {
 			TRACE(TORRENT, "kicking seeder peer=%s", p->getID().c_str());
 			p->shutdown();
-			continue;
 		}
-
-		/*
-		 * For every peer, see if they have stuff we want. If so, claim interest;
-		 * if not, revoke it.
-		 */
-		bool haveStuff = false;
-		for (unsigned int i = 0; i < numPieces; i++)
-			if (!havePiece[i] && p->hasPiece(i)) {
-				haveStuff = true;
-				break;
-			}
-
-		haveStuff ? p->claimInterest() : p->revokeInterest();
 	}
 }
 
@@ -1258,7 +1551,7 @@ Torrent::getPieceDetails() const
 		for (unsigned int i = 0; i < numPieces; i++) {
 			bool requested = false;
 			for (unsigned int j = 0; j < calculateChunksInPiece(i); j++)
-				if (haveRequestedChunk[(i * (pieceLen / TORRENT_CHUNK_SIZE)) + j].size() > 0) {
+				if (requestedChunk[(i * (pieceLen / TORRENT_CHUNK_SIZE)) + j]) {
 					requested = true;
 					break;
 				}
@@ -1288,13 +1581,11 @@ Torrent::getPeerDetails() const
 unsigned int 
 Torrent::getNumPiecesComplete() const
 {
-	unsigned int num = 0;
+	unsigned int num;
 
 	{
 		unique_lock<mutex> lock(mtx_data);
-		for (unsigned int i = 0; i < numPieces; i++)
-			if (havePiece[i] && !hashingPiece[i])
-				num++;
+		num = numPiecesComplete;
 	}
 
 	return num;
@@ -1319,9 +1610,9 @@ Torrent::getTracer() const
 }
 
 void
-Torrent::signalSender() const
+Torrent::signalSender(int fd) const
 {
-	overseer->signalSender();
+	overseer->signalSender(fd);
 }
 
 bool
@@ -1414,16 +1705,14 @@ Torrent::debugDump(FILE* f) const
 		} else {
 			for (unsigned int j = 0; j < calculateChunksInPiece(piece); j++) {
 				/* Only report individual chunks if there is something useful to report */
-				if (haveChunk[(piece * (pieceLen / TORRENT_CHUNK_SIZE)) + j] || !haveRequestedChunk[(piece * (pieceLen / TORRENT_CHUNK_SIZE)) + j].empty()) {
+				unsigned int chunkIndex = (piece * (pieceLen / TORRENT_CHUNK_SIZE)) + j;
+				if (haveChunk[chunkIndex] || requestedChunk[chunkIndex]) {
 					PRINT("   <chunk num=\"%u\">", j);
-					if (haveChunk[(piece * (pieceLen / TORRENT_CHUNK_SIZE)) + j]) {
+					if (haveChunk[chunkIndex]) {
 						PRINT("    <complete/>");
 					} else {
-						for (PeerList::const_iterator it = haveRequestedChunk[(piece * (pieceLen / TORRENT_CHUNK_SIZE)) + j].begin();
-								 it != haveRequestedChunk[(piece * (pieceLen / TORRENT_CHUNK_SIZE)) + j].end(); it++) {
-							Peer* p = *it;
-							PRINT("    <requested fromPeer=\"%s\"/>", p->getID().c_str());
-						}
+						map<unsigned int, unsigned int>::const_iterator it = duplicateChunkRequests.find(chunkIndex);
+						PRINT("    <requested fromPeers=\"%u\"/>", 1 + (it != duplicateChunkRequests.end() ? it->second : 0));
 					}
 					PRINT("   </chunk>");
 				}
@@ -1450,13 +1739,7 @@ Torrent::debugDump(FILE* f) const
 				PRINT("   <interested/>");
 			if (p->isPeerSnubbed())
 				PRINT("   <snubbed/>");
-			vector<bool> pm = p->getPieceMap();
-			unsigned int num_pieces = 0;
-			for (vector<bool>::iterator it = pm.begin();
-					 it != pm.end(); it++) {
-				if (*it)
-					num_pieces++;
-			}
+			unsigned int num_pieces = p->getPieceMap().count();
 			PRINT("   <pieces available=\"%u\" missing=\"%u\"/>", num_pieces, numPieces - num_pieces);
 			PRINT("  </peer>");
 		}
@@ -1604,6 +1887,13 @@ Torrent::storeStatus() const
 	{
 		unique_lock<mutex> lock(mtx_data);
 		for (unsigned int piece = 0; piece < numPieces; piece++) {
+			/*
+			 * Chunks that are only in memory will be lost, and so will the piece
+			 * if it hasn't been written yet.
+			 */
+			if (pieceBuffers.find(piece) != pieceBuffers.end())
+				continue;
+
 			/* We have the full piece if it's not hashing */
 			if (!hashingPiece[piece] && havePiece[piece])
 				piecemap[piece / 8] |= (1 << (piece % 8));
@@ -1664,10 +1954,10 @@ Torrent::restoreStatus(const MetaDictionary* status)
 		unique_lock<mutex> lock(mtx_data);
 		for (unsigned int piece = 0; piece < numPieces; piece++) {
 			if (pieces[piece / 8] & (1 << (piece % 8))) {
-				havePiece[piece] = true;
+				havePiece.set(piece, true);
+				picker->setWanted(piece, false);
 
-				/* Update the cardinality and left counters */
-				pieceCardinality[piece]++;
+				/* Update the left counter */
 				if (piece == numPieces - 1) {
 					left -= getTotalSize() % pieceLen > 0 ?
 									getTotalSize() % pieceLen : pieceLen;
@@ -1678,8 +1968,10 @@ Torrent::restoreStatus(const MetaDictionary* status)
 
 			for (unsigned int chunk = 0; chunk < calculateChunksInPiece(piece); chunk++) {
 				int chunkIdx = (piece * (pieceLen / TORRENT_CHUNK_SIZE)) + chunk;
-				if (chunks[chunkIdx / 8] & (1 << (chunkIdx % 8)))
-					haveChunk[chunkIdx] = true;
+				if (chunks[chunkIdx / 8] & (1 << (chunkIdx % 8))) {
+					haveChunk.set(chunkIdx, true);
+					numChunksReceived[piece]++;
+				}
 			}
 		}
 	}
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string>
 #include <time.h>
+#include "tortilla/multisha1.h"
 #include "tortilla/sha1.h"
 
 static const int CHUNK_SIZE = 4096;
@@ -36,8 +37,10 @@ time_diff(const struct timespec* a, const struct timespec* b)
 int
 main(int argc, char* argv[])
 {
-	if (argc != 2)
-		errx(1, "usage: need a filename");
+	if (argc != 2 && argc != 3)
+		errx(1, "usage: need a filename and optionally an implementation");
+	if (argc == 3 && !Tortilla::HashSHA1::setImplementation(argv[2]))
+		errx(1, "implementation '%s' is unknown or unsupported", argv[2]);
 
 	FILE* f = fopen(argv[1], "rb");
 	if (f == NULL)
@@ -65,7 +68,7 @@ main(int argc, char* argv[])
 	fprintf(stderr, "\rreading %lu bytes... done, %.2f KB/sec\n", l, ((float)l / 1024.f) / (time_diff(&begin_time, &end_time) / 1000000000.f));
 
 	{
-		fprintf(stderr, "hashing using own implementation    : ");
+		fprintf(stderr, "hashing using own implementation    : (%s)", Tortilla::HashSHA1::getImplementation());
 		struct timespec cur_time, done_time;
 		clock_gettime(CLOCK_REALTIME, &cur_time);
 		Tortilla::HashSHA1 hash;
@@ -80,6 +83,35 @@ main(int argc, char* argv[])
 		clock_gettime(CLOCK_REALTIME, &done_time);
 		fprintf(stderr, " ok, %s, ~%f ms\n", hash2ascii(hashval).c_str(), time_diff(&cur_time, &done_time) / 1000000.f);
 	}
+	{
+		/*
+		 * Split the file in equal slices and hash those side by side; this
+		 * should yield the same hashes as doing them one by one.
+		 */
+		unsigned int lanes = Tortilla::MultiHashSHA1::getMaxLanes();
+		unsigned long slice_len = l / lanes;
+		fprintf(stderr, "hashing %u slices using multi-buffer: ", lanes);
+		struct timespec cur_time, done_time;
+		clock_gettime(CLOCK_REALTIME, &cur_time);
+		Tortilla::MultiHashSHA1 hash(lanes);
+		for (unsigned long pos = 0; pos < slice_len; /* nothing */) {
+			unsigned int chunk_len = std::min(slice_len - pos, (unsigned long)CHUNK_SIZE);
+			const uint8_t* bufs[MULTISHA1_MAX_LANES];
+			for (unsigned int i = 0; i < lanes; i++)
+				bufs[i] = (const uint8_t*)(ptr + i * slice_len + pos);
+			hash.process(bufs, chunk_len);
+			pos += chunk_len;
+		}
+		hash.getHash(0);
+		clock_gettime(CLOCK_REALTIME, &done_time);
+		bool ok = true;
+		for (unsigned int i = 0; i < lanes; i++) {
+			Tortilla::HashSHA1 h;
+			h.process(ptr + i * slice_len, slice_len);
+			ok &= hash2ascii(h.getHash()) == hash2ascii(hash.getHash(i));
+		}
+		fprintf(stderr, " %s, ~%f ms\n", ok ? "ok" : "MISMATCH", time_diff(&cur_time, &done_time) / 1000000.f);
+	}
 	{
 		fprintf(stderr, "hashing using openssl implementation: ");
 		struct timespec cur_time, done_time;
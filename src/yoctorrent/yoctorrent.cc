@@ -129,9 +129,10 @@ run()
 void
 usage()
 {
-	fprintf(stderr, "usage: yoctorrent [h?] [-u upload] [-p port] file.torrent\n\n");
+	fprintf(stderr, "usage: yoctorrent [h?] [-u upload] [-d download] [-p port] file.torrent\n\n");
 	fprintf(stderr, "  -h, -?           this help\n");
 	fprintf(stderr, "  -u upload        upload rate, in KB/sec\n");
+	fprintf(stderr, "  -d download      download rate, in KB/sec\n");
 	fprintf(stderr, "  -p port          port to bind to\n");
 	exit(EXIT_FAILURE);
 }
@@ -141,13 +142,14 @@ main(int argc, char** argv)
 {
 	unsigned int port = 4000;
 	unsigned int upload = 0;
+	unsigned int download = 0;
 	srand(time(NULL));
 
 	/* XXX */
 	signal(SIGPIPE, SIG_IGN);
 
 	int ch;
-	while ((ch = getopt(argc, argv, "?hu:p:")) != -1) {
+	while ((ch = getopt(argc, argv, "?hu:d:p:")) != -1) {
 		switch (ch) {
 			case '?':
 			case 'h':
@@ -159,6 +161,11 @@ main(int argc, char** argv)
 				if (upload <= 0)
 					printf( ">> NOTE: upload ratio zero or unparsable, unlimited assumed!\n");
 				break;
+			case 'd':
+				download = atoi(optarg);
+				if (download <= 0)
+					printf( ">> NOTE: download ratio zero or unparsable, unlimited assumed!\n");
+				break;
 			case 'p':
 				port = atoi(optarg);
 				if (port <= 0) {
@@ -180,6 +187,7 @@ main(int argc, char** argv)
 	tracer = new Tortilla::Tracer();
 	overseer = new Tortilla::Overseer(port, tracer, callbacks);
 	overseer->setUploadRate(upload * 1024);
+	overseer->setDownloadRate(download * 1024);
 
 	ifstream is;
 	is.open(argv[0], ios::binary);